@@ -1,11 +1,310 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-int main() {
+#include "launch.h"
+
+// Bytes read from a job's output at a time
+#define READ_BYTES 65536
+
+// A command of a batch. It is finished once it has exited and closed its
+// output, which it shares with any children it leaves running.
+typedef struct job {
+  pid_t pid;  // 0 when the slot is free
+  int pidfd;  // -1 once reaped
+  int output; // read end of the pipe, -1 once closed
+  size_t number;
+  char *command;
+  int status;
+  double started;
+  double finished;
+  char *text; // output so far
+  size_t length;
+  size_t capacity;
+} job_t;
+
+typedef struct batch_stats {
+  size_t jobs;
+  size_t failed;
+  size_t ran;  // jobs that could be started
+  double busy; // total time they ran
+  double shortest;
+  double longest;
+} batch_stats_t;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_time(batch_stats_t *stats, double seconds) {
+  if (stats->ran == 0 || seconds < stats->shortest)
+    stats->shortest = seconds;
+  if (stats->ran == 0 || seconds > stats->longest)
+    stats->longest = seconds;
+  stats->busy += seconds;
+  stats->ran++;
+}
+
+// Splits line into words in place. Returns NULL for a blank line or when
+// out of memory.
+static char **split_words(char *line) {
+  size_t count = 0, capacity = 0;
+  char **words = NULL;
+  char *save = NULL;
+  for (char *word = strtok_r(line, " \t", &save);;
+       word = strtok_r(NULL, " \t", &save)) {
+    if (count == capacity) {
+      capacity = capacity * 2 + 8;
+      char **grown = realloc(words, capacity * sizeof(char *));
+      if (!grown) {
+        free(words);
+        return NULL;
+      }
+      words = grown;
+    }
+    words[count++] = word;
+    if (!word)
+      break;
+  }
+  if (!words[0]) {
+    free(words);
+    return NULL;
+  }
+  return words;
+}
+
+// Starts the command on line in the free slot job, watched by epoll under
+// its slot number: twice the slot for the process, one more for the output.
+// Returns false if it could not be started or watched.
+static bool start_job(job_t *job, size_t slot, int epoll, const char *line,
+                      size_t number) {
+  char *copy = strdup(line);
+  char **argv = copy ? split_words(copy) : NULL;
+  job->command = strdup(line);
+  job->number = number;
+  job->text = NULL;
+  job->length = job->capacity = 0;
+  int pipe_fds[2] = {-1, -1};
+  bool started = false;
+  if (argv && job->command && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+    job->started = now();
+    job->pid = launch_to(argv[0], argv, pipe_fds[1]);
+    started = job->pid > 0;
+  }
+  int saved = errno;
+  free(argv);
+  free(copy);
+  if (pipe_fds[1] >= 0)
+    close(pipe_fds[1]);
+  if (!started) {
+    if (pipe_fds[0] >= 0)
+      close(pipe_fds[0]);
+    fprintf(stderr, "[%zu] %s: %s\n", number, line, strerror(saved));
+    free(job->command);
+    job->pid = 0;
+    return false;
+  }
+
+  job->output = pipe_fds[0];
+  job->pidfd = (int)syscall(SYS_pidfd_open, job->pid, 0);
+  struct epoll_event process = {EPOLLIN, {.u64 = 2 * slot}};
+  struct epoll_event output = {EPOLLIN, {.u64 = 2 * slot + 1}};
+  bool watched = job->pidfd >= 0 &&
+                 epoll_ctl(epoll, EPOLL_CTL_ADD, job->pidfd, &process) == 0;
+  if (watched &&
+      epoll_ctl(epoll, EPOLL_CTL_ADD, job->output, &output) != 0) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, job->pidfd, NULL);
+    watched = false;
+  }
+  if (watched)
+    return true;
+
+  // Without a pidfd (before Linux 5.3, under seccomp or out of descriptors)
+  // the job cannot be waited for alongside the others. It counts as failed
+  // and is waited for here; with its output closed it cannot block writing.
+  fprintf(stderr, "[%zu] %s: cannot watch: %s\n", number, line,
+          strerror(errno));
+  if (job->pidfd >= 0)
+    close(job->pidfd);
+  close(job->output);
+  waitpid(job->pid, NULL, 0);
+  free(job->command);
+  job->pid = 0;
+  return false;
+}
+
+// Collects what the job wrote, until it closes its output
+static void read_output(job_t *job, int epoll) {
+  if (job->capacity - job->length < READ_BYTES) {
+    size_t capacity = job->capacity * 2 + READ_BYTES;
+    char *text = realloc(job->text, capacity);
+    if (!text) {
+      perror("realloc");
+      exit(1);
+    }
+    job->text = text;
+    job->capacity = capacity;
+  }
+  ssize_t got = read(job->output, job->text + job->length, READ_BYTES);
+  if (got > 0) {
+    job->length += (size_t)got;
+  } else if (got == 0 || errno != EINTR) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, job->output, NULL);
+    close(job->output);
+    job->output = -1;
+  }
+}
+
+static void reap(job_t *job, int epoll) {
+  waitpid(job->pid, &job->status, 0);
+  job->finished = now();
+  epoll_ctl(epoll, EPOLL_CTL_DEL, job->pidfd, NULL);
+  close(job->pidfd);
+  job->pidfd = -1;
+}
+
+// Prints a finished job's output in one piece, and frees its slot
+static void finish_job(job_t *job, batch_stats_t *stats) {
+  double seconds = job->finished - job->started;
+  record_time(stats, seconds);
+  stats->jobs++;
+  printf("[%zu] %s: ", job->number, job->command);
+  if (WIFEXITED(job->status))
+    printf("exit %d", WEXITSTATUS(job->status));
+  else
+    printf("signal %d", WTERMSIG(job->status));
+  printf(", %.1f ms\n", seconds * 1e3);
+  fwrite(job->text, 1, job->length, stdout);
+  if (job->length > 0 && job->text[job->length - 1] != '\n')
+    putchar('\n');
+  if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0)
+    stats->failed++;
+  free(job->command);
+  free(job->text);
+  job->pid = 0;
+}
+
+// Runs the command on each line of input, up to parallel at once, as
+// xargs -P does. Returns the number of commands that failed.
+static size_t run_batch(FILE *input, size_t parallel) {
+  job_t *jobs = calloc(parallel, sizeof(job_t));
+  int epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (!jobs || epoll < 0) {
+    perror("batch");
+    exit(1);
+  }
+  batch_stats_t stats = {0};
+  double begin = now();
+  char *line = NULL;
+  size_t size = 0, number = 0, running = 0;
+  bool more = true;
+
+  while (more || running > 0) {
+    // Keep every slot busy while there are commands left
+    for (size_t slot = 0; more && slot < parallel; slot++) {
+      while (more && jobs[slot].pid == 0) {
+        ssize_t length = getline(&line, &size, input);
+        if (length < 0) {
+          more = false;
+          break;
+        }
+        line[strcspn(line, "\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0')
+          continue;
+        number++;
+        if (start_job(&jobs[slot], slot, epoll, line, number)) {
+          running++;
+        } else {
+          stats.jobs++;
+          stats.failed++;
+        }
+      }
+    }
+    if (running == 0)
+      continue;
+
+    struct epoll_event events[16];
+    int ready = epoll_wait(epoll, events, 16, -1);
+    if (ready < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (int i = 0; i < ready; i++) {
+      job_t *job = &jobs[events[i].data.u64 / 2];
+      if (events[i].data.u64 % 2)
+        read_output(job, epoll);
+      else
+        reap(job, epoll);
+      if (job->pidfd < 0 && job->output < 0) {
+        finish_job(job, &stats);
+        running--;
+      }
+    }
+  }
+
+  double elapsed = now() - begin;
+  printf("%zu jobs, %zu failed, %zu at a time, %.3f s\n", stats.jobs,
+         stats.failed, parallel, elapsed);
+  if (stats.ran > 0)
+    printf("job time min %.1f ms, mean %.1f ms, max %.1f ms, "
+           "%.2f running on average\n",
+           stats.shortest * 1e3, stats.busy / stats.ran * 1e3,
+           stats.longest * 1e3, stats.busy / elapsed);
+  free(line);
+  free(jobs);
+  close(epoll);
+  return stats.failed;
+}
+
+// ./lab2 reads one path at a time and runs it. ./lab2 -P jobs [file] runs
+// each line of file, or of standard input, as a path and arguments
+// separated by blanks, with no quoting, jobs at a time.
+int main(int argc, char *argv[]) {
+  long parallel = 0;
+  bool batch = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "P:")) != -1) {
+    switch (opt) {
+    case 'P':
+      parallel = atol(optarg);
+      batch = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-P jobs] [file]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (!batch && optind < argc) {
+    parallel = 1;
+    batch = true;
+  }
+  if (batch && parallel < 1) {
+    fprintf(stderr, "Job count must be at least 1\n");
+    return 1;
+  }
+  if (batch) {
+    FILE *input = optind < argc ? fopen(argv[optind], "r") : stdin;
+    if (!input) {
+      perror(argv[optind]);
+      return 1;
+    }
+    size_t failed = run_batch(input, (size_t)parallel);
+    if (input != stdin)
+      fclose(input);
+    return failed > 0;
+  }
+
   while (1) {
     printf("Enter path:\n ");
 
@@ -23,17 +322,10 @@ int main() {
       buff[len - 1] = '\0';
     }
 
-    pid_t pid = fork();
+    char *args[] = {buff, NULL};
+    pid_t pid = launch(buff, args);
     if (pid < 0) {
-      perror("fork failed");
-      free(buff);
-      exit(1);
-    }
-
-    if (pid == 0) {
-      execl(buff, buff, (char *)NULL);
       perror("Exec failure");
-      exit(1);
     } else {
       int status;
       waitpid(pid, &status, 0);
@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include "launch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Output is -1 to leave the child's standard output and error alone
+static pid_t fork_exec(const char *path, char *const argv[], int output) {
+  // The child reports a failed exec down the pipe; a successful one closes
+  // it
+  int report[2];
+  if (pipe2(report, O_CLOEXEC) != 0)
+    return -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(report[0]);
+    if (output < 0 || (dup2(output, STDOUT_FILENO) >= 0 &&
+                       dup2(output, STDERR_FILENO) >= 0))
+      execve(path, argv, environ);
+    int error = errno;
+    while (write(report[1], &error, sizeof(error)) < 0 && errno == EINTR)
+      ;
+    _exit(127);
+  }
+  int saved = errno;
+  close(report[1]);
+  if (pid < 0) {
+    close(report[0]);
+    errno = saved;
+    return -1;
+  }
+  int error;
+  ssize_t got;
+  while ((got = read(report[0], &error, sizeof(error))) < 0 && errno == EINTR)
+    ;
+  close(report[0]);
+  if (got == 0)
+    return pid;
+  // Anything but a closed pipe means the exec did not happen, even if the
+  // report is cut short
+  if (got < 0)
+    error = errno;
+  else if (got < (ssize_t)sizeof(error))
+    error = EIO;
+  waitpid(pid, NULL, 0);
+  errno = error;
+  return -1;
+}
+
+pid_t launch(const char *path, char *const argv[]) {
+  return launch_to(path, argv, -1);
+}
+
+pid_t launch_to(const char *path, char *const argv[], int output) {
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+  posix_spawn_file_actions_t actions;
+  int error = posix_spawn_file_actions_init(&actions);
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  if (output >= 0) {
+    error = posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+    if (error == 0)
+      error = posix_spawn_file_actions_adddup2(&actions, output, STDERR_FILENO);
+  }
+  pid_t pid;
+  if (error == 0)
+    error = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (error == 0)
+    return pid;
+  // exec never fails with ENOSYS, so posix_spawn itself did
+  if (error != ENOSYS) {
+    errno = error;
+    return -1;
+  }
+#endif
+  return fork_exec(path, argv, output);
+}
+
+pid_t launch_fork(const char *path, char *const argv[]) {
+  return fork_exec(path, argv, -1);
+}
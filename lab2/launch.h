@@ -0,0 +1,23 @@
+// Starting programs without copying the caller. posix_spawn runs the child
+// on the parent's memory until it execs, as vfork does, so a launch costs
+// the same however large the parent has grown, where fork must first copy
+// its page tables.
+//
+//   gcc -O2 -o lab2 lab2.c launch.c
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <sys/types.h>
+
+// Runs path with argv, which ends in NULL, and the caller's environment.
+// Falls back to launch_fork only where posix_spawn is not built in or
+// returns ENOSYS; any other failure to start a process is returned.
+// Returns the child's pid, or -1 with errno set, including when path
+// cannot be executed.
+pid_t launch(const char *path, char *const argv[]);
+// The same with the child's standard output and error sent to output
+pid_t launch_to(const char *path, char *const argv[], int output);
+// The same with fork and exec
+pid_t launch_fork(const char *path, char *const argv[]);
+
+#endif
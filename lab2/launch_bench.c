@@ -0,0 +1,83 @@
+// Times launches of a short-lived program with fork and exec against
+// posix_spawn, as the launching process grows. Memory is added to the
+// parent and touched before each round, so fork has its page tables to
+// copy.
+//
+//   gcc -O2 -o launch_bench launch_bench.c launch.c
+//   ./launch_bench [max MiB] [launches] [program]
+//
+// Sizes double from 16 MiB up to max MiB. The program defaults to
+// /bin/true and is run without arguments.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "launch.h"
+
+#define DEFAULT_MAX_MIB 1024
+#define DEFAULT_LAUNCHES 200
+#define DEFAULT_PROGRAM "/bin/true"
+#define MIB (1024 * 1024)
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+// Launches a second
+static double run(pid_t (*start)(const char *, char *const[]),
+                  const char *program, int launches) {
+  char *argv[] = {(char *)program, NULL};
+  double begin = now();
+  for (int i = 0; i < launches; i++) {
+    pid_t pid = start(program, argv);
+    if (pid < 0)
+      die(program);
+    waitpid(pid, NULL, 0);
+  }
+  return launches / (now() - begin);
+}
+
+int main(int argc, char *argv[]) {
+  size_t max_mib = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_MAX_MIB;
+  int launches = argc > 2 ? atoi(argv[2]) : DEFAULT_LAUNCHES;
+  const char *program = argc > 3 ? argv[3] : DEFAULT_PROGRAM;
+  if (launches <= 0)
+    launches = DEFAULT_LAUNCHES;
+
+  printf("%s, launches/s\n", program);
+  printf("%-10s%-12s%-12s%s\n", "RSS MiB", "fork", "posix_spawn", "speedup");
+  char *memory = NULL;
+  size_t mapped = 0;
+  for (size_t mib = 0; mib <= max_mib; mib = mib ? mib * 2 : 16) {
+    if (mib > 0) {
+      // Grown by remapping, so the parent holds one mapping of mib MiB
+      char *grown = memory ? mremap(memory, mapped, mib * MIB, MREMAP_MAYMOVE)
+                           : mmap(NULL, mib * MIB, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (grown == MAP_FAILED)
+        die("mmap");
+      memset(grown + mapped, 1, mib * MIB - mapped);
+      memory = grown;
+      mapped = mib * MIB;
+    }
+    double forked = run(launch_fork, program, launches);
+    double spawned = run(launch, program, launches);
+    printf("%-10zu%-12.0f%-12.0f%.1fx\n", mib, forked, spawned,
+           spawned / forked);
+    fflush(stdout);
+  }
+  if (memory)
+    munmap(memory, mapped);
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "history.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct entry {
+  size_t offset;
+  size_t length; // without the terminator
+};
+
+// The text of the lines runs from the oldest's offset round to next,
+// except that a line never wraps: one that would not fit before the end of
+// the buffer starts again at 0, leaving the rest of the end unused.
+struct history {
+  char *text;
+  size_t bytes;
+  size_t next;
+  struct entry *entries; // ring of capacity entries, from first
+  size_t capacity;
+  size_t first;
+  size_t count;
+};
+
+history_t *history_create(size_t lines, size_t bytes) {
+  if (lines == 0 || bytes == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  history_t *history = malloc(sizeof(history_t));
+  if (!history)
+    return NULL;
+  history->text = malloc(bytes);
+  history->entries = calloc(lines, sizeof(struct entry));
+  if (!history->text || !history->entries) {
+    history_destroy(history);
+    return NULL;
+  }
+  history->bytes = bytes;
+  history->next = 0;
+  history->capacity = lines;
+  history->first = 0;
+  history->count = 0;
+  return history;
+}
+
+void history_destroy(history_t *history) {
+  free(history->text);
+  free(history->entries);
+  free(history);
+}
+
+static const struct entry *oldest(const history_t *history) {
+  return &history->entries[history->first];
+}
+
+static void drop_oldest(history_t *history) {
+  history->first = (history->first + 1) % history->capacity;
+  history->count--;
+}
+
+void history_add(history_t *history, const char *line, size_t length) {
+  if (length >= history->bytes)
+    length = history->bytes - 1;
+  size_t need = length + 1;
+  if (history->count == history->capacity)
+    drop_oldest(history);
+
+  size_t start = history->next;
+  if (start + need > history->bytes) {
+    // Any lines left between next and the end are the oldest
+    while (history->count > 0 && oldest(history)->offset >= history->next)
+      drop_oldest(history);
+    start = 0;
+  }
+  while (history->count > 0 && oldest(history)->offset < start + need &&
+         start < oldest(history)->offset + oldest(history)->length + 1)
+    drop_oldest(history);
+
+  memcpy(history->text + start, line, length);
+  history->text[start + length] = '\0';
+  size_t slot = (history->first + history->count) % history->capacity;
+  history->entries[slot].offset = start;
+  history->entries[slot].length = length;
+  history->count++;
+  history->next = start + need;
+}
+
+size_t history_count(const history_t *history) { return history->count; }
+
+const char *history_get(const history_t *history, size_t index,
+                        size_t *length) {
+  const struct entry *entry =
+      &history->entries[(history->first + index) % history->capacity];
+  if (length)
+    *length = entry->length;
+  return history->text + entry->offset;
+}
@@ -0,0 +1,30 @@
+// Command history packed into one circular byte buffer. Lines sit end to
+// end in the buffer with a ring of offsets indexing them, so adding a line
+// to a full history just writes over the oldest ones. Nothing is allocated
+// after history_create, however long the session.
+//
+//   gcc -O2 -o lab3 lab3.c history.c history_file.c
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+
+typedef struct history history_t;
+
+// Keeps at most lines lines in bytes bytes of text, counting a terminator
+// per line; whichever runs out first decides how many old lines are kept.
+// Returns NULL if either is 0 or out of memory.
+history_t *history_create(size_t lines, size_t bytes);
+void history_destroy(history_t *history);
+
+// Lines too long for the buffer are cut short
+void history_add(history_t *history, const char *line, size_t length);
+
+size_t history_count(const history_t *history);
+// The line at position index, oldest first, NUL-terminated and valid until
+// the next history_add. Its length is stored in *length unless length is
+// NULL.
+const char *history_get(const history_t *history, size_t index,
+                        size_t *length);
+
+#endif
@@ -0,0 +1,141 @@
+// Fills a history file with generated commands, then times reopening it
+// and searching it by prefix and by substring. Last it deletes the file,
+// leaving its index behind, and checks that a new file does not read it.
+//
+//   gcc -O2 -o history_bench history_bench.c history_file.c
+//   ./history_bench [path] [lines]
+//
+// The file and its index are removed afterwards.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history_file.h"
+
+#define DEFAULT_PATH "history_bench.tmp"
+#define DEFAULT_LINES 2000000
+#define SEARCHES 1000
+
+static const char *const commands[] = {"ls",   "cd",   "git",  "make",
+                                       "grep", "echo", "cat",  "vim",
+                                       "gcc",  "find", "ssh",  "man"};
+static const char *const words[] = {
+    "-la",     "src",   "status", "commit",  "build", "main.c", "TODO",
+    "--all",   "-O2",   "lab3",   "include", "*.h",   "log",    "origin",
+    "history", "tests", "docs",   "server",  "-rf",   "push"};
+
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+// Microseconds per search, stepping back through up to ten matches each
+static double time_search(history_file_t *history, const char *query,
+                          int flags) {
+  double start = now();
+  for (int i = 0; i < SEARCHES; i++) {
+    int64_t found = (int64_t)history_file_count(history);
+    for (int shown = 0; shown < 10 && found >= 0; shown++)
+      found = history_file_search(history, query, strlen(query),
+                                  (size_t)found, flags);
+  }
+  return (now() - start) / SEARCHES * 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = argc > 1 ? argv[1] : DEFAULT_PATH;
+  size_t n = argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_LINES;
+  char *index_path;
+  if (asprintf(&index_path, "%s.idx", path) < 0)
+    die("asprintf");
+  unlink(path);
+  unlink(index_path);
+
+  history_file_t *history = history_file_open(path);
+  if (!history)
+    die(path);
+  uint64_t rng = 88172645463325252ull;
+  double start = now();
+  for (size_t i = 0; i < n; i++) {
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%s",
+                          commands[next_random(&rng) % 12]);
+    for (int words_left = next_random(&rng) % 4; words_left > 0; words_left--)
+      length += snprintf(line + length, sizeof(line) - length, " %s",
+                         words[next_random(&rng) % 20]);
+    // A rare line to look for
+    if (next_random(&rng) % 100000 == 0)
+      length += snprintf(line + length, sizeof(line) - length, " needle");
+    if (history_file_append(history, line, (size_t)length) != 0)
+      die("history_file_append");
+  }
+  printf("%zu lines appended in %.2f s\n", n, now() - start);
+  history_file_close(history);
+
+  start = now();
+  history = history_file_open(path);
+  if (!history)
+    die(path);
+  printf("reopened in %.3f ms\n", (now() - start) * 1e3);
+
+  static const struct {
+    const char *query;
+    int flags;
+  } searches[] = {{"git c", HISTORY_PREFIX}, {"make -O2", HISTORY_PREFIX},
+                  {"status", 0},             {"needle", 0},
+                  {"no such line", 0},       {"lab3 hist", 0}};
+  for (size_t i = 0; i < sizeof(searches) / sizeof(searches[0]); i++)
+    printf("%-7s %-14s %9.2f us\n",
+           searches[i].flags & HISTORY_PREFIX ? "prefix" : "search",
+           searches[i].query,
+           time_search(history, searches[i].query, searches[i].flags));
+
+  history_file_close(history);
+
+  unlink(path);
+  history = history_file_open(path);
+  if (!history)
+    die(path);
+  if (history_file_count(history) != 0) {
+    fprintf(stderr, "new file holds %zu stale lines\n",
+            history_file_count(history));
+    return 1;
+  }
+  if (history_file_append(history, "echo hello", 10) != 0)
+    die("history_file_append");
+  history_file_close(history);
+  history = history_file_open(path);
+  if (!history)
+    die(path);
+  size_t length;
+  if (history_file_count(history) != 1 ||
+      strcmp(history_file_get(history, 0, &length), "echo hello") != 0 ||
+      history_file_search(history, "hello", 5, 1, 0) != 0) {
+    fprintf(stderr, "new file lost its line\n");
+    return 1;
+  }
+  printf("recreated file ignores the old index\n");
+
+  history_file_close(history);
+  unlink(path);
+  unlink(index_path);
+  free(index_path);
+  return 0;
+}
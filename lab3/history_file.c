@@ -0,0 +1,599 @@
+#define _GNU_SOURCE
+#include "history_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HISTORY_MAGIC "lab3hst2"
+#define SEGMENT_MAGIC "lab3seg2"
+#define MAGIC_BYTES 8
+// A line's position in its segment fits in 16 bits
+#define SEGMENT_ENTRIES 65536
+// Longer lines are cut short, which keeps a segment's records within 4 GiB
+// so offsets into them fit in 32 bits
+#define LINE_MAX_BYTES 32768
+#define GRAM 3
+// Grams are taken from each line with this in front, so prefix searches
+// can look for grams anchored at the start. Lines never contain it.
+#define LINE_START '\n'
+// Searches look up at most this many of a long query's grams
+#define MAX_QUERY_GRAMS 16
+// Mappings grow at least this much at a time, so appends rarely remap
+#define MIN_MAPPING (1 << 20)
+
+// Starts the records file. The id is made up when the file is created and
+// copied into every segment indexing it, so an index left behind by a
+// deleted history is not read against a new one.
+struct header {
+  char magic[MAGIC_BYTES];
+  uint64_t id;
+};
+
+// A record is its length, its text and a terminator, padded to 4 bytes
+struct record {
+  uint32_t length;
+  char text[];
+};
+
+// Followed by uint32_t offsets[SEGMENT_ENTRIES] of its records from
+// records_start, struct gram grams[grams] sorted by gram, and the
+// positions of the lines holding each gram, ascending, as uint16_t
+// postings[postings]
+struct segment {
+  char magic[MAGIC_BYTES];
+  uint64_t records_id;
+  uint64_t first_entry;
+  uint64_t records_start;
+  uint64_t records_end;
+  uint64_t bytes; // of the segment, header included
+  uint32_t grams;
+  uint32_t postings;
+};
+
+struct gram {
+  uint32_t gram;
+  uint32_t first; // in postings
+  uint32_t count;
+};
+
+struct mapping {
+  const char *data;
+  size_t mapped;
+  size_t size; // of the file
+};
+
+struct history_file {
+  uint64_t id;
+  int fd;
+  int index_fd;
+  struct mapping records;
+  struct mapping index;
+  // Offsets of the segments in the index, which cover the first
+  // segment_count * SEGMENT_ENTRIES lines
+  size_t *segments;
+  size_t segment_count;
+  size_t segment_capacity;
+  size_t index_end; // of the last segment
+  // Offsets of the lines after the segments, up to records_end
+  size_t *tail;
+  size_t tail_count;
+  size_t records_end;
+};
+
+static size_t record_bytes(uint32_t length) {
+  return (sizeof(struct record) + length + 1 + 3) & ~(size_t)3;
+}
+
+static const struct record *record_at(const history_file_t *history,
+                                      size_t offset) {
+  return (const struct record *)(history->records.data + offset);
+}
+
+static const struct segment *segment_at(const history_file_t *history,
+                                        size_t s) {
+  return (const struct segment *)(history->index.data + history->segments[s]);
+}
+
+static const uint32_t *segment_offsets(const struct segment *segment) {
+  return (const uint32_t *)(segment + 1);
+}
+
+static const struct gram *segment_grams(const struct segment *segment) {
+  return (const struct gram *)(segment_offsets(segment) + SEGMENT_ENTRIES);
+}
+
+static const uint16_t *segment_postings(const struct segment *segment) {
+  return (const uint16_t *)(segment_grams(segment) + segment->grams);
+}
+
+static const struct record *entry_record(const history_file_t *history,
+                                         size_t index) {
+  size_t s = index / SEGMENT_ENTRIES;
+  if (s >= history->segment_count)
+    return record_at(history, history->tail[index % SEGMENT_ENTRIES]);
+  const struct segment *segment = segment_at(history, s);
+  uint32_t offset = segment_offsets(segment)[index % SEGMENT_ENTRIES];
+  return record_at(history, segment->records_start + offset);
+}
+
+// Maps all of fd, remapping only when it has outgrown the mapping. The
+// mapping runs past the end of the file, but nothing beyond size is read:
+// size follows the file down as well as up, as pages past its end fault.
+static int map_file(int fd, struct mapping *mapping) {
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return -1;
+  size_t size = (size_t)st.st_size;
+  if (size > mapping->mapped) {
+    size_t mapped = mapping->mapped ? mapping->mapped : MIN_MAPPING;
+    while (mapped < size)
+      mapped *= 2;
+    void *data = mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+      return -1;
+    if (mapping->data)
+      munmap((void *)mapping->data, mapping->mapped);
+    mapping->data = data;
+    mapping->mapped = mapped;
+  }
+  mapping->size = size;
+  return 0;
+}
+
+// Takes in the segments sealed since the last call, by any session. The
+// lines they cover leave the tail.
+static int load_index(history_file_t *history) {
+  if (map_file(history->index_fd, &history->index) != 0)
+    return -1;
+  size_t loaded = history->segment_count;
+  while (history->index_end <= history->index.size &&
+         history->index.size - history->index_end >= sizeof(struct segment)) {
+    const struct segment *segment =
+        (const struct segment *)(history->index.data + history->index_end);
+    // Another session may still be writing it, or it may index some other
+    // records file. Either way it and whatever follows it are not read,
+    // and the next seal_tail truncates them away.
+    const struct segment *last =
+        history->segment_count
+            ? segment_at(history, history->segment_count - 1)
+            : NULL;
+    uint64_t records_start = last ? last->records_end : sizeof(struct header);
+    if (memcmp(segment->magic, SEGMENT_MAGIC, MAGIC_BYTES) != 0 ||
+        segment->records_id != history->id ||
+        segment->first_entry != history->segment_count * SEGMENT_ENTRIES ||
+        segment->bytes > history->index.size - history->index_end ||
+        segment->bytes < sizeof(struct segment) +
+                             SEGMENT_ENTRIES * sizeof(uint32_t) +
+                             (uint64_t)segment->grams * sizeof(struct gram) +
+                             (uint64_t)segment->postings * sizeof(uint16_t) ||
+        segment->records_start != records_start ||
+        segment->records_end <= segment->records_start ||
+        segment->records_end > history->records.size ||
+        segment_offsets(segment)[SEGMENT_ENTRIES - 1] >=
+            segment->records_end - segment->records_start)
+      break;
+    if (history->segment_count == history->segment_capacity) {
+      size_t capacity = history->segment_capacity * 2 + 16;
+      size_t *segments =
+          realloc(history->segments, capacity * sizeof(size_t));
+      if (!segments)
+        return -1;
+      history->segments = segments;
+      history->segment_capacity = capacity;
+    }
+    history->segments[history->segment_count++] = history->index_end;
+    history->index_end += segment->bytes;
+  }
+  if (history->segment_count > loaded) {
+    history->tail_count = 0;
+    history->records_end =
+        segment_at(history, history->segment_count - 1)->records_end;
+  }
+  return 0;
+}
+
+static uint32_t gram_at(const unsigned char *p) {
+  return (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+}
+
+// Sorts keys of up to 40 bits into tmp, least significant byte first. The
+// odd number of passes leaves the result there.
+static void radix_sort(uint64_t *keys, uint64_t *tmp, size_t n) {
+  for (int b = 0; b < 5; b++) {
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < n; i++)
+      counts[(keys[i] >> (8 * b)) & 0xff]++;
+    size_t offset = 0;
+    for (int d = 0; d < 256; d++) {
+      size_t count = counts[d];
+      counts[d] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < n; i++)
+      tmp[counts[(keys[i] >> (8 * b)) & 0xff]++] = keys[i];
+    uint64_t *swap = keys;
+    keys = tmp;
+    tmp = swap;
+  }
+}
+
+static int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += written;
+    size -= (size_t)written;
+  }
+  return 0;
+}
+
+// Indexes the full tail into a new segment at the end of the index
+static int write_segment(history_file_t *history) {
+  // Each gram of each line as gram << 16 | position, sorted and deduped
+  // into the posting lists
+  size_t pair_count = 0;
+  for (size_t i = 0; i < SEGMENT_ENTRIES; i++) {
+    uint32_t length = record_at(history, history->tail[i])->length;
+    if (length + 1 >= GRAM)
+      pair_count += length + 2 - GRAM;
+  }
+  uint64_t *pairs = malloc((pair_count + 1) * sizeof(uint64_t));
+  uint64_t *tmp = malloc((pair_count + 1) * sizeof(uint64_t));
+  if (!pairs || !tmp) {
+    free(pairs);
+    free(tmp);
+    return -1;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < SEGMENT_ENTRIES; i++) {
+    const struct record *record = record_at(history, history->tail[i]);
+    const unsigned char *text = (const unsigned char *)record->text;
+    if (record->length + 1 < GRAM)
+      continue;
+    unsigned char start[GRAM] = {LINE_START, text[0], text[1]};
+    pairs[n++] = (uint64_t)gram_at(start) << 16 | i;
+    for (uint32_t j = 0; j + GRAM <= record->length; j++)
+      pairs[n++] = (uint64_t)gram_at(text + j) << 16 | i;
+  }
+  radix_sort(pairs, tmp, n);
+  size_t postings = 0, grams = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i > 0 && tmp[i] == tmp[i - 1])
+      continue;
+    if (i == 0 || tmp[i] >> 16 != tmp[i - 1] >> 16)
+      grams++;
+    tmp[postings++] = tmp[i];
+  }
+
+  size_t bytes = sizeof(struct segment) + SEGMENT_ENTRIES * sizeof(uint32_t) +
+                 grams * sizeof(struct gram) + postings * sizeof(uint16_t);
+  bytes = (bytes + 7) & ~(size_t)7;
+  struct segment *segment = calloc(1, bytes);
+  if (!segment) {
+    free(pairs);
+    free(tmp);
+    return -1;
+  }
+  memcpy(segment->magic, SEGMENT_MAGIC, MAGIC_BYTES);
+  segment->records_id = history->id;
+  segment->first_entry = history->segment_count * SEGMENT_ENTRIES;
+  segment->records_start = history->tail[0];
+  segment->records_end = history->records_end;
+  segment->bytes = bytes;
+  segment->grams = (uint32_t)grams;
+  segment->postings = (uint32_t)postings;
+  uint32_t *offsets = (uint32_t *)(segment + 1);
+  for (size_t i = 0; i < SEGMENT_ENTRIES; i++)
+    offsets[i] = (uint32_t)(history->tail[i] - history->tail[0]);
+  struct gram *table = (struct gram *)(offsets + SEGMENT_ENTRIES);
+  uint16_t *positions = (uint16_t *)(table + grams);
+  struct gram *gram = table - 1;
+  for (size_t i = 0; i < postings; i++) {
+    if (i == 0 || tmp[i] >> 16 != tmp[i - 1] >> 16) {
+      gram++;
+      gram->gram = (uint32_t)(tmp[i] >> 16);
+      gram->first = (uint32_t)i;
+    }
+    gram->count++;
+    positions[i] = (uint16_t)tmp[i];
+  }
+  free(pairs);
+  free(tmp);
+
+  int status = write_all(history->index_fd, (const char *)segment, bytes);
+  free(segment);
+  return status;
+}
+
+// Seals the full tail, unless another session got there first
+static int seal_tail(history_file_t *history) {
+  if (flock(history->index_fd, LOCK_EX) != 0)
+    return -1;
+  size_t sealed = history->segment_count;
+  int status = load_index(history);
+  if (status == 0 && history->segment_count == sealed) {
+    // Whatever follows the last segment was left by a session that died
+    // writing one
+    status = ftruncate(history->index_fd, (off_t)history->index_end);
+    if (status == 0)
+      status = write_segment(history);
+    if (status == 0)
+      status = load_index(history);
+    if (status == 0 && history->segment_count == sealed) {
+      errno = EIO;
+      status = -1;
+    }
+  }
+  flock(history->index_fd, LOCK_UN);
+  return status;
+}
+
+int history_file_refresh(history_file_t *history) {
+  for (;;) {
+    // The index goes first: every line a segment covers was on disk before
+    // the segment, so it is mapped below
+    if (load_index(history) != 0 || map_file(history->fd, &history->records))
+      return -1;
+    size_t offset = history->records_end;
+    while (history->tail_count < SEGMENT_ENTRIES &&
+           history->records.size - offset >= sizeof(struct record)) {
+      uint32_t length = record_at(history, offset)->length;
+      // A record that is not all there is still being appended
+      if (length > LINE_MAX_BYTES ||
+          record_bytes(length) > history->records.size - offset)
+        break;
+      history->tail[history->tail_count++] = offset;
+      offset += record_bytes(length);
+      history->records_end = offset;
+    }
+    if (history->tail_count < SEGMENT_ENTRIES)
+      return 0;
+    if (seal_tail(history) != 0)
+      return -1;
+  }
+}
+
+history_file_t *history_file_open(const char *path) {
+  history_file_t *history = calloc(1, sizeof(history_file_t));
+  if (!history)
+    return NULL;
+  history->fd = -1;
+  history->index_fd = -1;
+  history->tail = malloc(SEGMENT_ENTRIES * sizeof(size_t));
+  size_t path_length = strlen(path);
+  char *index_path = malloc(path_length + sizeof(".idx"));
+  if (!history->tail || !index_path)
+    goto fail;
+  memcpy(index_path, path, path_length);
+  memcpy(index_path + path_length, ".idx", sizeof(".idx"));
+
+  history->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history->fd < 0)
+    goto fail;
+
+  // Whoever finds the file empty writes its header and starts a new index.
+  // The old index is unlinked rather than truncated, as sessions still
+  // reading it through a deleted records file would fault on it.
+  struct stat st;
+  if (flock(history->fd, LOCK_EX) != 0)
+    goto fail;
+  int status = fstat(history->fd, &st);
+  if (status == 0 && st.st_size == 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct header header = {HISTORY_MAGIC,
+                            ((uint64_t)now.tv_sec * 1000000000 +
+                             (uint64_t)now.tv_nsec) ^
+                                (uint64_t)st.st_ino << 32 ^ (uint64_t)getpid()};
+    status = write_all(history->fd, (const char *)&header, sizeof(header));
+    if (status == 0 && unlink(index_path) != 0 && errno != ENOENT)
+      status = -1;
+  }
+  if (status == 0) {
+    history->index_fd =
+        open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history->index_fd < 0)
+      status = -1;
+  }
+  int error = errno;
+  flock(history->fd, LOCK_UN);
+  errno = error;
+  if (status != 0 || map_file(history->fd, &history->records) != 0)
+    goto fail;
+  const struct header *header = (const struct header *)history->records.data;
+  if (history->records.size < sizeof(struct header) ||
+      memcmp(header->magic, HISTORY_MAGIC, MAGIC_BYTES) != 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+  history->id = header->id;
+  history->records_end = sizeof(struct header);
+  if (history_file_refresh(history) != 0)
+    goto fail;
+  free(index_path);
+  return history;
+
+fail:;
+  int saved = errno;
+  free(index_path);
+  history_file_close(history);
+  errno = saved;
+  return NULL;
+}
+
+void history_file_close(history_file_t *history) {
+  if (history->records.data)
+    munmap((void *)history->records.data, history->records.mapped);
+  if (history->index.data)
+    munmap((void *)history->index.data, history->index.mapped);
+  if (history->fd >= 0)
+    close(history->fd);
+  if (history->index_fd >= 0)
+    close(history->index_fd);
+  free(history->segments);
+  free(history->tail);
+  free(history);
+}
+
+int history_file_append(history_file_t *history, const char *line,
+                        size_t length) {
+  static const char padding[4];
+  if (length > LINE_MAX_BYTES)
+    length = LINE_MAX_BYTES;
+  uint32_t header = (uint32_t)length;
+  size_t bytes = record_bytes(header);
+  // One write, so records from concurrent sessions never interleave
+  struct iovec parts[] = {{&header, sizeof(header)},
+                          {(void *)line, length},
+                          {(void *)padding, bytes - sizeof(header) - length}};
+  ssize_t written = writev(history->fd, parts, 3);
+  if (written < 0)
+    return -1;
+  if ((size_t)written != bytes) {
+    errno = EIO;
+    return -1;
+  }
+  return history_file_refresh(history);
+}
+
+size_t history_file_count(const history_file_t *history) {
+  return history->segment_count * SEGMENT_ENTRIES + history->tail_count;
+}
+
+const char *history_file_get(const history_file_t *history, size_t index,
+                             size_t *length) {
+  const struct record *record = entry_record(history, index);
+  if (length)
+    *length = record->length;
+  return record->text;
+}
+
+static bool line_matches(const struct record *record, const char *query,
+                         size_t length, int flags) {
+  if (flags & HISTORY_PREFIX)
+    return record->length >= length &&
+           memcmp(record->text, query, length) == 0;
+  return memmem(record->text, record->length, query, length) != NULL;
+}
+
+// Whether position is in a posting list
+static bool posted(const uint16_t *list, uint32_t count, uint16_t position) {
+  uint32_t lo = 0, n = count;
+  while (n > 0) {
+    uint32_t half = n / 2;
+    if (list[lo + half] < position) {
+      lo += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  return lo < count && list[lo] == position;
+}
+
+static const struct gram *find_gram(const struct segment *segment,
+                                    uint32_t gram) {
+  const struct gram *grams = segment_grams(segment);
+  uint32_t lo = 0, n = segment->grams;
+  while (n > 0) {
+    uint32_t half = n / 2;
+    if (grams[lo + half].gram < gram) {
+      lo += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  return lo < segment->grams && grams[lo].gram == gram ? &grams[lo] : NULL;
+}
+
+// The newest line below position limit in segment s that matches
+static int64_t search_segment(const history_file_t *history, size_t s,
+                              const char *query, size_t length, int flags,
+                              size_t limit) {
+  const struct segment *segment = segment_at(history, s);
+  size_t first = s * SEGMENT_ENTRIES;
+  // The grams to look for, anchored at the line start for a prefix
+  unsigned char pattern[MAX_QUERY_GRAMS + GRAM - 1];
+  size_t pattern_length = 0;
+  if (flags & HISTORY_PREFIX)
+    pattern[pattern_length++] = LINE_START;
+  size_t take = length < sizeof(pattern) - pattern_length
+                    ? length
+                    : sizeof(pattern) - pattern_length;
+  memcpy(pattern + pattern_length, query, take);
+  pattern_length += take;
+
+  if (pattern_length < GRAM) {
+    for (size_t i = limit; i-- > 0;) {
+      if (line_matches(entry_record(history, first + i), query, length, flags))
+        return (int64_t)(first + i);
+    }
+    return -1;
+  }
+
+  const uint16_t *postings = segment_postings(segment);
+  const struct gram *lists[MAX_QUERY_GRAMS];
+  size_t list_count = 0, shortest = 0;
+  for (size_t i = 0; i + GRAM <= pattern_length; i++) {
+    const struct gram *gram = find_gram(segment, gram_at(pattern + i));
+    if (!gram)
+      return -1;
+    if (list_count == 0 || gram->count < lists[shortest]->count)
+      shortest = list_count;
+    lists[list_count++] = gram;
+  }
+
+  const struct gram *driver = lists[shortest];
+  for (uint32_t i = driver->count; i-- > 0;) {
+    uint16_t position = postings[driver->first + i];
+    if (position >= limit)
+      continue;
+    bool candidate = true;
+    for (size_t j = 0; j < list_count && candidate; j++)
+      candidate = j == shortest || posted(postings + lists[j]->first,
+                                          lists[j]->count, position);
+    if (candidate &&
+        line_matches(entry_record(history, first + position), query, length,
+                     flags))
+      return (int64_t)(first + position);
+  }
+  return -1;
+}
+
+int64_t history_file_search(const history_file_t *history, const char *query,
+                            size_t length, size_t before, int flags) {
+  size_t count = history_file_count(history);
+  if (before > count)
+    before = count;
+  size_t sealed = history->segment_count * SEGMENT_ENTRIES;
+  for (size_t i = before; i-- > sealed;) {
+    if (line_matches(entry_record(history, i), query, length, flags))
+      return (int64_t)i;
+  }
+  for (size_t s = (before < sealed ? before : sealed) / SEGMENT_ENTRIES + 1;
+       s-- > 0;) {
+    if (s >= history->segment_count)
+      continue;
+    size_t limit = before - s * SEGMENT_ENTRIES;
+    if (limit > SEGMENT_ENTRIES)
+      limit = SEGMENT_ENTRIES;
+    int64_t found = search_segment(history, s, query, length, flags, limit);
+    if (found >= 0)
+      return found;
+  }
+  return -1;
+}
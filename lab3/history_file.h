@@ -0,0 +1,49 @@
+// Command history kept on disk and shared by every session that opens the
+// same file. Lines are appended as length-prefixed records, which other
+// sessions pick up on their next refresh; everything is read through
+// mmap. Every SEGMENT_ENTRIES lines are sealed into an index segment in a
+// second file, path.idx, holding their offsets and a trigram index of
+// their text. Opening a history therefore only walks the lines since the
+// last segment, and searches skip straight to the lines that can match.
+//
+//   gcc -O2 -o lab3 lab3.c history.c history_file.c
+#ifndef HISTORY_FILE_H
+#define HISTORY_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// history_file_search flag: match lines starting with the query rather
+// than containing it
+#define HISTORY_PREFIX 1
+
+typedef struct history_file history_file_t;
+
+// Creates the files if they do not exist. Returns NULL with errno set on
+// failure, EINVAL if path is not a history file.
+history_file_t *history_file_open(const char *path);
+void history_file_close(history_file_t *history);
+
+// Lines too long for a record are cut short. Returns -1 with errno set on
+// failure.
+int history_file_append(history_file_t *history, const char *line,
+                        size_t length);
+// Picks up lines other sessions have appended. Returns -1 with errno set
+// on failure.
+int history_file_refresh(history_file_t *history);
+
+size_t history_file_count(const history_file_t *history);
+// The line at position index, oldest first, NUL-terminated and valid
+// until the next append or refresh. Its length is stored in *length
+// unless length is NULL.
+const char *history_file_get(const history_file_t *history, size_t index,
+                             size_t *length);
+
+// The newest line before position before that contains query, or starts
+// with it given HISTORY_PREFIX, or -1 if there is none. Searching again
+// from the result steps back through older matches, as reverse
+// incremental search does.
+int64_t history_file_search(const history_file_t *history, const char *query,
+                            size_t length, size_t before, int flags);
+
+#endif
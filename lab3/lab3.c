@@ -1,29 +1,90 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+
+#include "history.h"
+#include "history_file.h"
+
 #define MAX_SIZE 5
-int main() {
-  char *history[MAX_SIZE];
-  int head = 0;
-  int count = 0;
+// Room in the history's text buffer per line; sessions of longer lines
+// keep fewer of them
+#define LINE_BYTES 128
+#define HISTORY_FILE ".lab3_history"
+// Matches shown per search, newest first
+#define MAX_MATCHES 10
+
+static history_file_t *open_history_file(void) {
+  const char *home = getenv("HOME");
+  char *path = NULL;
+  if (home ? asprintf(&path, "%s/%s", home, HISTORY_FILE) < 0
+           : !(path = strdup(HISTORY_FILE)))
+    return NULL;
+  history_file_t *file = history_file_open(path);
+  if (file == NULL)
+    perror(path);
+  free(path);
+  return file;
+}
+
+// Lists the lines before the command itself that contain the query, or
+// start with it
+static void search(history_file_t *file, const char *query, int flags) {
+  int64_t found = (int64_t)history_file_count(file) - 1;
+  for (int shown = 0; shown < MAX_MATCHES; shown++) {
+    found = history_file_search(file, query, strlen(query), (size_t)found,
+                                flags);
+    if (found < 0)
+      break;
+    printf("%6lld  %s\n", (long long)found + 1,
+           history_file_get(file, (size_t)found, NULL));
+  }
+}
+
+// ./lab3 [history lines]
+int main(int argc, char *argv[]) {
+  size_t lines = argc > 1 ? strtoull(argv[1], NULL, 10) : MAX_SIZE;
+  history_t *history = history_create(lines, lines * LINE_BYTES);
+  if (history == NULL) {
+    perror("history_create");
+    return 1;
+  }
+  // Without the file, history lasts the session and search is off
+  history_file_t *file = open_history_file();
+  if (file) {
+    size_t count = history_file_count(file);
+    for (size_t i = count > lines ? count - lines : 0; i < count; i++) {
+      size_t length;
+      const char *text = history_file_get(file, i, &length);
+      history_add(history, text, length);
+    }
+  }
   char *line = NULL;
   size_t len = 0;
 
   while (1) {
     printf("Enter input: ");
-    getline(&line, &len, stdin);
+    if (getline(&line, &len, stdin) < 0)
+      break;
     line[strcspn(line, "\n")] = '\0';
-    history[head] = strdup(line);
-    head = (head + 1) % MAX_SIZE;
-    if (count < MAX_SIZE)
-      count++;
+    history_add(history, line, strlen(line));
+    if (file && history_file_append(file, line, strlen(line)) != 0) {
+      perror("history_file_append");
+      history_file_close(file);
+      file = NULL;
+    }
     if (strcmp(line, "print") == 0) {
-      int start = (head - count + MAX_SIZE) % MAX_SIZE;
-      for (int i = 0; i < count; i++) {
-        int idx = (start + i) % MAX_SIZE;
-        printf("%s\n", history[idx]);
-      }
+      for (size_t i = 0; i < history_count(history); i++)
+        printf("%s\n", history_get(history, i, NULL));
+    } else if (file && strncmp(line, "search ", 7) == 0) {
+      search(file, line + 7, 0);
+    } else if (file && strncmp(line, "prefix ", 7) == 0) {
+      search(file, line + 7, HISTORY_PREFIX);
     }
   }
+  free(line);
+  if (file)
+    history_file_close(file);
+  history_destroy(history);
   return 0;
 }
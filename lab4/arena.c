@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HUGE_PAGE (2 << 20)
+#define DEFAULT_CHUNK HUGE_PAGE
+#define MAX_CHUNK (64 << 20)
+
+// Chunks are linked newest first and allocation bumps through the newest
+struct arena_chunk {
+  struct arena_chunk *prev;
+  size_t size;
+};
+
+struct arena {
+  char *next; // first free byte of the current chunk
+  char *end;
+  struct arena_chunk *chunks;
+  size_t next_chunk_size;
+  size_t used;
+  size_t mapped;
+};
+
+static size_t round_up(size_t n, size_t to) { return (n + to - 1) & ~(to - 1); }
+
+// Chunks of a huge page or more are placed on a huge page boundary and
+// offered to transparent huge pages, so a large arena costs few TLB entries
+static struct arena_chunk *map_chunk(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  if (size < HUGE_PAGE) {
+    size = round_up(size, page);
+    void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+      return NULL;
+    ((struct arena_chunk *)chunk)->size = size;
+    return chunk;
+  }
+
+  size = round_up(size, HUGE_PAGE);
+  char *raw = mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    return NULL;
+  char *start = (char *)round_up((uintptr_t)raw, HUGE_PAGE);
+  if (start > raw)
+    munmap(raw, start - raw);
+  if (raw + HUGE_PAGE > start)
+    munmap(start + size, raw + HUGE_PAGE - start);
+#ifdef MADV_HUGEPAGE
+  madvise(start, size, MADV_HUGEPAGE);
+#endif
+  ((struct arena_chunk *)start)->size = size;
+  return (struct arena_chunk *)start;
+}
+
+// Starts a chunk big enough for min_free bytes of allocations
+static int add_chunk(arena_t *arena, size_t min_free) {
+  size_t size = arena->next_chunk_size;
+  if (size < min_free + sizeof(struct arena_chunk))
+    size = min_free + sizeof(struct arena_chunk);
+  struct arena_chunk *chunk = map_chunk(size);
+  if (!chunk)
+    return -1;
+
+  chunk->prev = arena->chunks;
+  arena->chunks = chunk;
+  arena->next = (char *)(chunk + 1);
+  arena->end = (char *)chunk + chunk->size;
+  arena->mapped += chunk->size;
+  if (arena->next_chunk_size < MAX_CHUNK)
+    arena->next_chunk_size *= 2;
+  return 0;
+}
+
+arena_t *arena_create(size_t chunk_size) {
+  arena_t *arena = calloc(1, sizeof(arena_t));
+  if (!arena)
+    return NULL;
+  arena->next_chunk_size = chunk_size ? chunk_size : DEFAULT_CHUNK;
+  if (add_chunk(arena, 0) != 0) {
+    free(arena);
+    return NULL;
+  }
+  return arena;
+}
+
+void arena_destroy(arena_t *arena) {
+  while (arena->chunks) {
+    struct arena_chunk *prev = arena->chunks->prev;
+    munmap(arena->chunks, arena->chunks->size);
+    arena->chunks = prev;
+  }
+  free(arena);
+}
+
+void *arena_alloc_aligned(arena_t *arena, size_t size, size_t alignment) {
+  if (alignment < ARENA_ALIGNMENT)
+    alignment = ARENA_ALIGNMENT;
+  if (size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4)
+    return NULL;
+
+  char *p = (char *)round_up((uintptr_t)arena->next, alignment);
+  if (p > arena->end || size > (size_t)(arena->end - p)) {
+    if (add_chunk(arena, size + alignment) != 0)
+      return NULL;
+    p = (char *)round_up((uintptr_t)arena->next, alignment);
+  }
+  arena->used += (size_t)(p + size - arena->next);
+  arena->next = p + size;
+  return p;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  return arena_alloc_aligned(arena, size, ARENA_ALIGNMENT);
+}
+
+void *arena_memdup(arena_t *arena, const void *src, size_t size) {
+  void *copy = arena_alloc(arena, size);
+  if (copy)
+    memcpy(copy, src, size);
+  return copy;
+}
+
+void arena_reset(arena_t *arena) {
+  struct arena_chunk *keep = arena->chunks;
+  for (struct arena_chunk *c = arena->chunks; c; c = c->prev) {
+    if (c->size > keep->size)
+      keep = c;
+  }
+  while (arena->chunks) {
+    struct arena_chunk *prev = arena->chunks->prev;
+    if (arena->chunks != keep)
+      munmap(arena->chunks, arena->chunks->size);
+    arena->chunks = prev;
+  }
+
+  keep->prev = NULL;
+  arena->chunks = keep;
+  arena->next = (char *)(keep + 1);
+  arena->end = (char *)keep + keep->size;
+  arena->used = 0;
+  arena->mapped = keep->size;
+}
+
+size_t arena_bytes_used(const arena_t *arena) { return arena->used; }
+
+size_t arena_bytes_mapped(const arena_t *arena) { return arena->mapped; }
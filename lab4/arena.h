@@ -0,0 +1,35 @@
+// Region allocator: bump allocation out of large mmapped chunks, with
+// everything released at once by arena_reset or arena_destroy.
+//
+//   gcc -O2 -o lab4 lab4.c arena.c
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Alignment of every arena_alloc result
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena arena_t;
+
+// chunk_size is the size of the first chunk (0 for the default); later
+// chunks double up to a cap. Returns NULL if the first chunk cannot be
+// mapped.
+arena_t *arena_create(size_t chunk_size);
+void arena_destroy(arena_t *arena);
+
+// Return NULL only when the OS refuses more memory
+void *arena_alloc(arena_t *arena, size_t size);
+// alignment must be a power of two
+void *arena_alloc_aligned(arena_t *arena, size_t size, size_t alignment);
+void *arena_memdup(arena_t *arena, const void *src, size_t size);
+
+// Frees every allocation at once. The largest chunk is kept for reuse, so
+// an arena reset between requests stops mapping memory once it has grown
+// to the size of a request.
+void arena_reset(arena_t *arena);
+
+size_t arena_bytes_used(const arena_t *arena);
+size_t arena_bytes_mapped(const arena_t *arena);
+
+#endif
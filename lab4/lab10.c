@@ -67,6 +67,8 @@ int main() {
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "arena.h"
+
 #define BUF_SIZE 1024
 #define PORT 8001
 #define LISTEN_BACKLOG 32
@@ -95,6 +97,7 @@ struct client_args {
   int cfd;
   struct list_handle *list_handle;
   pthread_mutex_t *list_lock;
+  arena_t *arena; // owned by this client alone, so allocation is lock-free
 };
 
 struct acceptor_args {
@@ -102,6 +105,7 @@ struct acceptor_args {
 
   struct list_handle *list_handle;
   pthread_mutex_t *list_lock;
+  arena_t **arenas; // one per client slot
 };
 
 int init_server_socket() {
@@ -156,11 +160,8 @@ int collect_all(struct list_node head) {
     printf("Collected: %s\n", (char *)node->data);
     total++;
 
-    // Free node and advance to next item
-    struct list_node *next = node->next;
-    free(node->data);
-    free(node);
-    node = next;
+    // Nodes live in the client arenas, which main releases as a whole
+    node = node->next;
   }
 
   return total;
@@ -184,10 +185,18 @@ static void *run_client(void *args) {
     } else if (bytes_read == 0) {
       break;
     } else if (bytes_read > 0) {
-      struct list_node *new_node = malloc(sizeof(struct list_node));
+      struct list_node *new_node =
+          arena_alloc(cargs->arena, sizeof(struct list_node));
+      if (!new_node) {
+        perror("arena_alloc");
+        break;
+      }
       new_node->next = NULL;
-      new_node->data = malloc(BUF_SIZE);
-      memcpy(new_node->data, msg_buf, BUF_SIZE);
+      new_node->data = arena_memdup(cargs->arena, msg_buf, BUF_SIZE);
+      if (!new_node->data) {
+        perror("arena_memdup");
+        break;
+      }
 
       struct list_handle *list_handle = cargs->list_handle;
       pthread_mutex_lock(cargs->list_lock);
@@ -228,6 +237,7 @@ static void *run_acceptor(void *args) {
         atomic_store(&client_args[num_clients].run, true);
         client_args[num_clients].list_handle = aargs->list_handle;
         client_args[num_clients].list_lock = aargs->list_lock;
+        client_args[num_clients].arena = aargs->arenas[num_clients];
 
         if (pthread_create(&threads[num_clients], NULL, run_client,
                            &client_args[num_clients]) != 0) {
@@ -273,11 +283,22 @@ int main() {
       .count = 0,
   };
 
+  // Messages are only freed together after collection, so each client
+  // thread bump-allocates them from its own arena instead of calling malloc
+  arena_t *arenas[MAX_CLIENTS];
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    arenas[i] = arena_create(0);
+    if (!arenas[i]) {
+      handle_error("arena_create");
+    }
+  }
+
   pthread_t acceptor_thread;
   struct acceptor_args aargs;
   atomic_store(&aargs.run, true);
   aargs.list_handle = &list_handle;
   aargs.list_lock = &list_mutex;
+  aargs.arenas = arenas;
 
   if (pthread_create(&acceptor_thread, NULL, run_acceptor, &aargs) != 0) {
     perror("pthread_create acceptor");
@@ -315,6 +336,9 @@ int main() {
   }
 
   pthread_mutex_destroy(&list_mutex);
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    arena_destroy(arenas[i]);
+  }
 
   return 0;
 }
@@ -3,16 +3,25 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+
+#include "arena.h"
+
 struct header {
   uint64_t size;
   struct header *next;
 };
 
 int main() {
-  void *block_start = sbrk(256);
+  // The blocks used to be carved by hand out of sbrk(256); an arena hands
+  // out aligned blocks from mmapped chunks and frees them all in one go
+  arena_t *arena = arena_create(0);
+  if (!arena) {
+    perror("arena_create");
+    return 1;
+  }
 
-  struct header *block1 = (struct header *)block_start;
-  struct header *block2 = (struct header *)((char *)block_start + 128);
+  struct header *block1 = arena_alloc(arena, 128);
+  struct header *block2 = arena_alloc(arena, 128);
 
   block1->size = 128;
   block1->next = NULL;
@@ -47,5 +56,11 @@ int main() {
     }
   }
 
+  printf("arena used: %zu of %zu bytes\n", arena_bytes_used(arena),
+         arena_bytes_mapped(arena));
+  arena_reset(arena);
+  printf("after reset: %zu bytes used\n", arena_bytes_used(arena));
+  arena_destroy(arena);
+
   return 0;
 }
@@ -0,0 +1,1227 @@
+#define _GNU_SOURCE
+#include "alloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALIGNMENT 16
+#define WORD sizeof(size_t)
+#define MIN_BLOCK 32 // size word, two free-list links and a footer
+#define CHUNK_SIZE (1 << 20)
+#define MMAP_THRESHOLD (256 * 1024)
+// Blocks of 32, 48, ..., 512 bytes each get an exact class. Bigger ones are
+// classed TLSF-style: each power of two [2^k, 2^(k+1)) is split into
+// SUB_CLASSES ranges of equal width.
+#define EXACT_CLASSES 31
+#define MAX_EXACT 512
+#define MIN_LOG2 9
+#define MAX_LOG2 47
+#define SUB_CLASS_BITS 4
+#define SUB_CLASSES (1 << SUB_CLASS_BITS)
+#define NUM_CLASSES                                                            \
+  (EXACT_CLASSES + (MAX_LOG2 - MIN_LOG2 + 1) * SUB_CLASSES)
+#define CLASS_WORDS ((NUM_CLASSES + 63) / 64)
+// Thread caches hold blocks of the exact classes. A bin that runs dry is
+// refilled with CACHE_BATCH blocks and one that reaches CACHE_LIMIT hands
+// CACHE_BATCH back, so the heap lock is taken once per batch.
+#define CACHE_CLASSES EXACT_CLASSES
+#define CACHE_BATCH 16
+#define CACHE_LIMIT (2 * CACHE_BATCH)
+#define TRACE_RECORDS 4096 // per thread buffer, 256 KiB
+
+// Low bits of a size word; block sizes are multiples of 16
+#define ALLOCATED 1
+#define PREV_ALLOCATED 2
+#define MMAPPED 4
+#define FLAGS 15
+
+// Every block starts with a size word and its payload follows on a 16-byte
+// boundary. A free block keeps its free-list links at the start of the
+// payload and a copy of its size (the footer) in its last word, so the
+// block after it can find it. Allocated blocks carry no footer; instead
+// PREV_ALLOCATED in the following block says whether there is one to read.
+struct header {
+  size_t size;
+  struct header *next;
+  struct header *prev;
+};
+
+// One mmap of blocks. The first header sits CHUNK_FIRST bytes in so that
+// payloads are aligned, and a zero-sized allocated header ends the chunk.
+struct chunk {
+  struct chunk *prev;
+  struct chunk *next;
+  size_t size;
+  size_t pad;
+};
+#define CHUNK_FIRST (sizeof(struct chunk) + WORD)
+#define CHUNK_OVERHEAD (CHUNK_FIRST + WORD)
+
+// A block of at least MMAP_THRESHOLD bytes mapped on its own. The word
+// before its size word holds the payload's distance from the mapping.
+struct mapping {
+  struct mapping *prev;
+  struct mapping *next;
+  size_t size;
+  size_t pad;
+};
+#define MAPPING_FIRST (sizeof(struct mapping) + 2 * WORD)
+
+// A thread's private stock of small blocks, linked through their next
+// fields. The heap sees cached blocks as allocated, so a block may be freed
+// into any thread's cache regardless of which one handed it out.
+struct thread_cache {
+  alloc_heap_t *heap;
+  struct header *bins[CACHE_CLASSES];
+  uint32_t counts[CACHE_CLASSES];
+};
+
+// Records of one thread's calls on a traced heap. Only the owning thread
+// touches it, and it writes the records out itself when the buffer fills,
+// so tracing takes no lock.
+struct trace_buffer {
+  alloc_heap_t *heap;
+  uint32_t thread;
+  uint32_t count;
+  alloc_trace_record_t records[TRACE_RECORDS];
+};
+
+struct alloc_heap {
+  pthread_mutex_t lock;
+  alloc_policy_t policy;
+  // Two-level bitmap of non-empty free lists: bit c of nonempty is set while
+  // free_lists[c] has blocks, and bit w of nonempty_words while
+  // nonempty[w] has any bit set
+  uint64_t nonempty_words;
+  uint64_t nonempty[CLASS_WORDS];
+  struct header *free_lists[NUM_CLASSES];
+  struct chunk *chunks;
+  struct mapping *mappings;
+  alloc_stats_t stats;
+  int checking; // run the consistency check after every operation
+  int caching;  // small blocks go through per-thread caches
+  pthread_key_t cache_key;
+  uint32_t last_scan; // blocks scanned since the current call took the lock
+  int tracing;
+  int trace_fd;
+  pthread_key_t trace_key;
+};
+
+static size_t page_size;
+
+static size_t round_up(size_t n, size_t to) { return (n + to - 1) & ~(to - 1); }
+
+static size_t block_size(const struct header *b) {
+  return b->size & ~(size_t)FLAGS;
+}
+
+static struct header *next_block(struct header *b) {
+  return (struct header *)((char *)b + block_size(b));
+}
+
+static struct header *prev_block(struct header *b) {
+  size_t prev_size = *((size_t *)b - 1);
+  return (struct header *)((char *)b - prev_size);
+}
+
+static void *payload(struct header *b) { return (char *)b + WORD; }
+
+static struct header *block_of(const void *ptr) {
+  return (struct header *)((char *)ptr - WORD);
+}
+
+// Block size needed for a request, or 0 if it cannot be represented
+static size_t request_size(size_t size) {
+  if (size > SIZE_MAX / 2)
+    return 0;
+  size_t need = round_up(size + WORD, ALIGNMENT);
+  return need < MIN_BLOCK ? MIN_BLOCK : need;
+}
+
+static int log2_of(size_t n) { return 63 - __builtin_clzll(n); }
+
+// The class a free block of this size is filed under
+static int class_of(size_t size) {
+  if (size <= MAX_EXACT)
+    return (int)(size / ALIGNMENT) - 2;
+  int log2 = log2_of(size);
+  if (log2 > MAX_LOG2)
+    return NUM_CLASSES - 1;
+  int sub = (int)(size >> (log2 - SUB_CLASS_BITS)) & (SUB_CLASSES - 1);
+  return EXACT_CLASSES + (log2 - MIN_LOG2) * SUB_CLASSES + sub;
+}
+
+// The first class whose blocks are all at least size bytes
+static int fitting_class_of(size_t size) {
+  if (size <= MAX_EXACT)
+    return class_of(size);
+  size_t width = (size_t)1 << (log2_of(size) - SUB_CLASS_BITS);
+  return class_of(size + width - 1);
+}
+
+static void set_nonempty(alloc_heap_t *heap, int c) {
+  heap->nonempty[c / 64] |= 1ull << (c % 64);
+  heap->nonempty_words |= 1ull << (c / 64);
+}
+
+static void clear_nonempty(alloc_heap_t *heap, int c) {
+  heap->nonempty[c / 64] &= ~(1ull << (c % 64));
+  if (!heap->nonempty[c / 64])
+    heap->nonempty_words &= ~(1ull << (c / 64));
+}
+
+// Lowest non-empty class at or above c, or -1
+static int next_nonempty(const alloc_heap_t *heap, int c) {
+  if (c >= NUM_CLASSES)
+    return -1;
+  int w = c / 64;
+  uint64_t bits = heap->nonempty[w] & (~0ull << (c % 64));
+  if (!bits) {
+    uint64_t words = w + 1 < 64 ? heap->nonempty_words & (~0ull << (w + 1)) : 0;
+    if (!words)
+      return -1;
+    w = __builtin_ctzll(words);
+    bits = heap->nonempty[w];
+  }
+  return w * 64 + __builtin_ctzll(bits);
+}
+
+// Highest non-empty class, or -1
+static int last_nonempty(const alloc_heap_t *heap) {
+  if (!heap->nonempty_words)
+    return -1;
+  int w = 63 - __builtin_clzll(heap->nonempty_words);
+  return w * 64 + 63 - __builtin_clzll(heap->nonempty[w]);
+}
+
+static void insert_free(alloc_heap_t *heap, struct header *b) {
+  int c = class_of(block_size(b));
+  b->prev = NULL;
+  b->next = heap->free_lists[c];
+  if (b->next)
+    b->next->prev = b;
+  heap->free_lists[c] = b;
+  set_nonempty(heap, c);
+  heap->stats.free_bytes += block_size(b);
+  heap->stats.free_blocks++;
+}
+
+static void remove_free(alloc_heap_t *heap, struct header *b) {
+  int c = class_of(block_size(b));
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    heap->free_lists[c] = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  if (!heap->free_lists[c])
+    clear_nonempty(heap, c);
+  heap->stats.free_bytes -= block_size(b);
+  heap->stats.free_blocks--;
+}
+
+// Writes b's header and footer as a free block of size bytes
+static void mark_free(struct header *b, size_t size, size_t prev_allocated) {
+  b->size = size | prev_allocated;
+  *(size_t *)((char *)b + size - WORD) = size;
+  next_block(b)->size &= ~(size_t)PREV_ALLOCATED;
+}
+
+// First block that fits: the block's own class is searched in list order,
+// then the head of the next non-empty class is taken
+static struct header *find_first_fit(alloc_heap_t *heap, size_t size,
+                                     uint32_t *scanned) {
+  int c = class_of(size);
+  for (struct header *b = heap->free_lists[c]; b; b = b->next) {
+    ++*scanned;
+    if (block_size(b) >= size)
+      return b;
+  }
+  c = next_nonempty(heap, c + 1);
+  if (c < 0)
+    return NULL;
+  ++*scanned;
+  return heap->free_lists[c];
+}
+
+// Smallest block that fits, to within the width of a class (1/16 of the
+// size). The head of the request's own class is taken when it fits;
+// otherwise the first non-empty class that surely fits supplies one, which
+// the bitmaps find in constant time.
+static struct header *find_best_fit(alloc_heap_t *heap, size_t size,
+                                    uint32_t *scanned) {
+  struct header *b = heap->free_lists[class_of(size)];
+  if (b) {
+    ++*scanned;
+    if (block_size(b) >= size)
+      return b;
+  }
+  int c = next_nonempty(heap, fitting_class_of(size));
+  if (c < 0)
+    return NULL;
+  ++*scanned;
+  return heap->free_lists[c];
+}
+
+// Largest free block, to within the width of a class: the first in the
+// top class that fits. Nothing fits if none of that class does.
+static struct header *find_worst_fit(alloc_heap_t *heap, size_t size,
+                                     uint32_t *scanned) {
+  int c = last_nonempty(heap);
+  if (c < 0)
+    return NULL;
+  for (struct header *b = heap->free_lists[c]; b; b = b->next) {
+    ++*scanned;
+    if (block_size(b) >= size)
+      return b;
+  }
+  return NULL;
+}
+
+static struct header *find_fit(alloc_heap_t *heap, size_t size) {
+  uint32_t scanned = 0;
+  struct header *b;
+  switch (heap->policy) {
+  case ALLOC_BEST_FIT:
+    b = find_best_fit(heap, size, &scanned);
+    break;
+  case ALLOC_WORST_FIT:
+    b = find_worst_fit(heap, size, &scanned);
+    break;
+  default:
+    b = find_first_fit(heap, size, &scanned);
+  }
+  heap->last_scan += scanned;
+  heap->stats.scanned_blocks += scanned;
+  return b;
+}
+
+// Maps a new chunk with room for a block of size bytes and returns that
+// room as one free block
+static struct header *add_chunk(alloc_heap_t *heap, size_t size) {
+  size_t chunk_size = round_up(size + CHUNK_OVERHEAD, page_size);
+  if (chunk_size < CHUNK_SIZE)
+    chunk_size = CHUNK_SIZE;
+  struct chunk *chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED)
+    return NULL;
+
+  chunk->size = chunk_size;
+  chunk->prev = NULL;
+  chunk->next = heap->chunks;
+  if (chunk->next)
+    chunk->next->prev = chunk;
+  heap->chunks = chunk;
+  heap->stats.chunks++;
+  heap->stats.mapped_bytes += chunk_size;
+  if (heap->stats.mapped_bytes > heap->stats.peak_mapped_bytes)
+    heap->stats.peak_mapped_bytes = heap->stats.mapped_bytes;
+
+  struct header *end = (struct header *)((char *)chunk + chunk_size - WORD);
+  end->size = ALLOCATED;
+  struct header *b = (struct header *)((char *)chunk + CHUNK_FIRST);
+  mark_free(b, chunk_size - CHUNK_OVERHEAD, PREV_ALLOCATED);
+  insert_free(heap, b);
+  return b;
+}
+
+// The chunk b is the only block of, if any
+static struct chunk *chunk_if_sole_block(alloc_heap_t *heap,
+                                         struct header *b) {
+  if (next_block(b)->size != ALLOCATED ||
+      ((uintptr_t)b - CHUNK_FIRST) % page_size != 0)
+    return NULL;
+  for (struct chunk *chunk = heap->chunks; chunk; chunk = chunk->next) {
+    if ((char *)chunk + CHUNK_FIRST == (char *)b)
+      return chunk;
+  }
+  return NULL;
+}
+
+static void release_chunk(alloc_heap_t *heap, struct chunk *chunk) {
+  if (chunk->prev)
+    chunk->prev->next = chunk->next;
+  else
+    heap->chunks = chunk->next;
+  if (chunk->next)
+    chunk->next->prev = chunk->prev;
+  heap->stats.chunks--;
+  heap->stats.mapped_bytes -= chunk->size;
+  munmap(chunk, chunk->size);
+}
+
+// Turns free block b into an allocated block of size bytes, returning any
+// usable tail to the free lists
+static void place(alloc_heap_t *heap, struct header *b, size_t size) {
+  size_t total = block_size(b);
+  remove_free(heap, b);
+  if (total - size >= MIN_BLOCK) {
+    b->size = size | ALLOCATED | (b->size & PREV_ALLOCATED);
+    struct header *rest = next_block(b);
+    mark_free(rest, total - size, PREV_ALLOCATED);
+    insert_free(heap, rest);
+  } else {
+    b->size |= ALLOCATED;
+    next_block(b)->size |= PREV_ALLOCATED;
+    size = total;
+  }
+  heap->stats.allocated_bytes += size;
+}
+
+// Frees b, merging it with whichever physical neighbours are free. A chunk
+// left holding a single free block goes back to the OS unless it is the
+// heap's last one.
+static void release_block(alloc_heap_t *heap, struct header *b) {
+  size_t size = block_size(b);
+  heap->stats.allocated_bytes -= size;
+
+  struct header *next = next_block(b);
+  if (!(next->size & ALLOCATED)) {
+    remove_free(heap, next);
+    size += block_size(next);
+  }
+  if (!(b->size & PREV_ALLOCATED)) {
+    b = prev_block(b);
+    remove_free(heap, b);
+    size += block_size(b);
+  }
+  // The block before a free block is always allocated
+  mark_free(b, size, PREV_ALLOCATED);
+
+  struct chunk *chunk;
+  if (heap->stats.chunks > 1 && (chunk = chunk_if_sole_block(heap, b)))
+    release_chunk(heap, chunk);
+  else
+    insert_free(heap, b);
+}
+
+// Splits the part of allocated block b past size bytes off as a free block
+// if it is big enough to be one
+static void trim(alloc_heap_t *heap, struct header *b, size_t size) {
+  size_t total = block_size(b);
+  if (total - size < MIN_BLOCK)
+    return;
+  b->size = size | (b->size & FLAGS);
+  struct header *rest = next_block(b);
+  rest->size = (total - size) | ALLOCATED | PREV_ALLOCATED;
+  release_block(heap, rest);
+}
+
+static void *map_block(alloc_heap_t *heap, size_t size, size_t alignment) {
+  if (size > SIZE_MAX / 2)
+    return NULL;
+  size_t map_size = round_up(
+      MAPPING_FIRST + size + (alignment > ALIGNMENT ? alignment : 0),
+      page_size);
+  char *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  struct mapping *m = (struct mapping *)base;
+  m->size = map_size;
+  m->prev = NULL;
+  m->next = heap->mappings;
+  if (m->next)
+    m->next->prev = m;
+  heap->mappings = m;
+  heap->stats.mapped_bytes += map_size;
+  if (heap->stats.mapped_bytes > heap->stats.peak_mapped_bytes)
+    heap->stats.peak_mapped_bytes = heap->stats.mapped_bytes;
+  heap->stats.allocated_bytes += map_size;
+
+  uintptr_t p = round_up((uintptr_t)base + MAPPING_FIRST,
+                         alignment > ALIGNMENT ? alignment : ALIGNMENT);
+  ((size_t *)p)[-2] = p - (uintptr_t)base;
+  ((size_t *)p)[-1] = map_size | ALLOCATED | MMAPPED;
+  return (void *)p;
+}
+
+static struct mapping *mapping_of(const void *ptr) {
+  return (struct mapping *)((char *)ptr - ((const size_t *)ptr)[-2]);
+}
+
+static void unmap_block(alloc_heap_t *heap, void *ptr) {
+  struct mapping *m = mapping_of(ptr);
+  if (m->prev)
+    m->prev->next = m->next;
+  else
+    heap->mappings = m->next;
+  if (m->next)
+    m->next->prev = m->prev;
+  heap->stats.mapped_bytes -= m->size;
+  heap->stats.allocated_bytes -= m->size;
+  munmap(m, m->size);
+}
+
+// Resizes a mapped block in place or by letting the kernel move its pages
+static void *remap_block(alloc_heap_t *heap, void *ptr, size_t size) {
+  struct mapping *m = mapping_of(ptr);
+  size_t offset = ((size_t *)ptr)[-2];
+  size_t old_size = m->size;
+  size_t map_size = round_up(offset + size, page_size);
+  struct mapping *moved = mremap(m, old_size, map_size, MREMAP_MAYMOVE);
+  if (moved == MAP_FAILED)
+    return NULL;
+
+  moved->size = map_size;
+  if (moved->prev)
+    moved->prev->next = moved;
+  else
+    heap->mappings = moved;
+  if (moved->next)
+    moved->next->prev = moved;
+  heap->stats.mapped_bytes += map_size - old_size;
+  heap->stats.allocated_bytes += map_size - old_size;
+  if (heap->stats.mapped_bytes > heap->stats.peak_mapped_bytes)
+    heap->stats.peak_mapped_bytes = heap->stats.mapped_bytes;
+
+  char *p = (char *)moved + offset;
+  ((size_t *)p)[-1] = map_size | ALLOCATED | MMAPPED;
+  return p;
+}
+
+static void *malloc_locked(alloc_heap_t *heap, size_t size) {
+  if (size >= MMAP_THRESHOLD)
+    return map_block(heap, size, ALIGNMENT);
+  size_t need = request_size(size);
+  if (!need)
+    return NULL;
+  struct header *b = find_fit(heap, need);
+  if (!b && !(b = add_chunk(heap, need)))
+    return NULL;
+  place(heap, b, need);
+  return payload(b);
+}
+
+static void free_locked(alloc_heap_t *heap, void *ptr) {
+  if (block_of(ptr)->size & MMAPPED)
+    unmap_block(heap, ptr);
+  else
+    release_block(heap, block_of(ptr));
+}
+
+static void *realloc_locked(alloc_heap_t *heap, void *ptr, size_t size) {
+  struct header *b = block_of(ptr);
+  if (b->size & MMAPPED) {
+    size_t usable = alloc_usable_size(ptr);
+    if (size <= usable && size >= usable / 2)
+      return ptr;
+    if (size >= MMAP_THRESHOLD)
+      return remap_block(heap, ptr, size);
+  } else if (size < MMAP_THRESHOLD) {
+    size_t need = request_size(size);
+    size_t total = block_size(b);
+    if (need <= total) {
+      trim(heap, b, need);
+      return ptr;
+    }
+    // Grow into a free successor
+    struct header *next = next_block(b);
+    if (!(next->size & ALLOCATED) && total + block_size(next) >= need) {
+      size_t next_size = block_size(next);
+      remove_free(heap, next);
+      b->size = (total + next_size) | (b->size & FLAGS);
+      next_block(b)->size |= PREV_ALLOCATED;
+      heap->stats.allocated_bytes += next_size;
+      trim(heap, b, need);
+      return ptr;
+    }
+  }
+
+  void *moved = malloc_locked(heap, size);
+  if (!moved)
+    return NULL;
+  size_t old = alloc_usable_size(ptr);
+  memcpy(moved, ptr, old < size ? old : size);
+  free_locked(heap, ptr);
+  return moved;
+}
+
+static void *memalign_locked(alloc_heap_t *heap, size_t alignment,
+                             size_t size) {
+  if (alignment <= ALIGNMENT)
+    return malloc_locked(heap, size);
+  size_t need = request_size(size);
+  if (!need || need + alignment + MIN_BLOCK >= MMAP_THRESHOLD)
+    return map_block(heap, size, alignment);
+
+  // Over-allocate, then give back the misaligned head and the spare tail
+  char *p = malloc_locked(heap, need + alignment + MIN_BLOCK);
+  if (!p)
+    return NULL;
+  struct header *b = block_of(p);
+  char *aligned = (char *)round_up((uintptr_t)p, alignment);
+  if (aligned != p) {
+    while ((size_t)(aligned - p) < MIN_BLOCK)
+      aligned += alignment;
+    size_t head = (size_t)(aligned - p);
+    struct header *a = block_of(aligned);
+    a->size = (block_size(b) - head) | ALLOCATED | PREV_ALLOCATED;
+    b->size = head | ALLOCATED | (b->size & PREV_ALLOCATED);
+    release_block(heap, b);
+    b = a;
+  }
+  trim(heap, b, need);
+  return payload(b);
+}
+
+// Reports one inconsistency without allocating, since the heap being
+// checked may be the one behind malloc
+static void report_problem(const char *format, ...) {
+  char message[160];
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(message, sizeof(message) - 1, format, args);
+  va_end(args);
+  if (n < 0)
+    return;
+  if (n > (int)sizeof(message) - 2)
+    n = (int)sizeof(message) - 2;
+  message[n++] = '\n';
+  if (write(STDERR_FILENO, message, n) < 0)
+    return;
+}
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      report_problem("alloc check: " __VA_ARGS__);                             \
+      problems++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// Walks every block of every chunk, then every free list, and checks them
+// against each other and against the heap's statistics
+static int check_locked(alloc_heap_t *heap) {
+  int problems = 0;
+  size_t mapped = 0, allocated = 0, free_bytes = 0, free_blocks = 0;
+  size_t chunks = 0;
+
+  for (struct chunk *chunk = heap->chunks; chunk; chunk = chunk->next) {
+    chunks++;
+    mapped += chunk->size;
+    CHECK(chunk->size % page_size == 0, "chunk %p has size %zu",
+          (void *)chunk, chunk->size);
+    CHECK(!chunk->next || chunk->next->prev == chunk,
+          "chunk %p is not linked back", (void *)chunk->next);
+    char *end = (char *)chunk + chunk->size - WORD;
+    struct header *b = (struct header *)((char *)chunk + CHUNK_FIRST);
+    size_t prev_allocated = PREV_ALLOCATED;
+    while ((char *)b < end) {
+      size_t size = block_size(b);
+      if (size < MIN_BLOCK || size % ALIGNMENT || (char *)b + size > end) {
+        CHECK(0, "block %p has size %zu", (void *)b, size);
+        break;
+      }
+      CHECK((b->size & PREV_ALLOCATED) == prev_allocated,
+            "block %p has a stale PREV_ALLOCATED bit", (void *)b);
+      CHECK(!(b->size & MMAPPED), "block %p is marked mapped", (void *)b);
+      if (b->size & ALLOCATED) {
+        allocated += size;
+        prev_allocated = PREV_ALLOCATED;
+      } else {
+        free_bytes += size;
+        free_blocks++;
+        CHECK(prev_allocated, "free block %p follows a free block",
+              (void *)b);
+        CHECK(*(size_t *)((char *)b + size - WORD) == size,
+              "free block %p has a footer that disagrees with its header",
+              (void *)b);
+        prev_allocated = 0;
+      }
+      b = next_block(b);
+    }
+    CHECK((char *)b == end && block_size(b) == 0 && (b->size & ALLOCATED),
+          "chunk %p does not end in its end marker", (void *)chunk);
+    CHECK((b->size & PREV_ALLOCATED) == prev_allocated,
+          "chunk %p end marker has a stale PREV_ALLOCATED bit",
+          (void *)chunk);
+  }
+
+  size_t listed_bytes = 0, listed_blocks = 0;
+  for (int c = 0; c < NUM_CLASSES; c++) {
+    int marked = (heap->nonempty[c / 64] >> (c % 64)) & 1;
+    CHECK(marked == (heap->free_lists[c] != NULL),
+          "class %d is %s but marked %s", c,
+          heap->free_lists[c] ? "non-empty" : "empty",
+          marked ? "non-empty" : "empty");
+    struct header *prev = NULL;
+    for (struct header *b = heap->free_lists[c]; b; b = b->next) {
+      // More blocks than the walk found means the list has a cycle
+      if (++listed_blocks > free_blocks) {
+        CHECK(0, "class %d lists more blocks than the heap has free", c);
+        break;
+      }
+      listed_bytes += block_size(b);
+      CHECK(!(b->size & ALLOCATED), "allocated block %p is on class %d",
+            (void *)b, c);
+      CHECK(class_of(block_size(b)) == c,
+            "block %p of %zu bytes is on class %d", (void *)b, block_size(b),
+            c);
+      CHECK(b->prev == prev, "block %p on class %d is not linked back",
+            (void *)b, c);
+      prev = b;
+    }
+  }
+  for (int w = 0; w < CLASS_WORDS; w++) {
+    CHECK(((heap->nonempty_words >> w) & 1) == (heap->nonempty[w] != 0),
+          "summary bit %d disagrees with its word", w);
+  }
+  CHECK(listed_blocks == free_blocks && listed_bytes == free_bytes,
+        "free lists hold %zu blocks (%zu bytes) but chunks %zu (%zu bytes)",
+        listed_blocks, listed_bytes, free_blocks, free_bytes);
+
+  for (struct mapping *m = heap->mappings; m; m = m->next) {
+    mapped += m->size;
+    allocated += m->size;
+    CHECK(!m->next || m->next->prev == m, "mapping %p is not linked back",
+          (void *)m->next);
+  }
+
+  CHECK(heap->stats.chunks == chunks, "stats count %zu chunks, found %zu",
+        heap->stats.chunks, chunks);
+  CHECK(heap->stats.mapped_bytes == mapped,
+        "stats count %zu mapped bytes, found %zu", heap->stats.mapped_bytes,
+        mapped);
+  CHECK(heap->stats.allocated_bytes == allocated,
+        "stats count %zu allocated bytes, found %zu",
+        heap->stats.allocated_bytes, allocated);
+  CHECK(heap->stats.free_bytes == free_bytes &&
+            heap->stats.free_blocks == free_blocks,
+        "stats count %zu free blocks (%zu bytes), found %zu (%zu bytes)",
+        heap->stats.free_blocks, heap->stats.free_bytes, free_blocks,
+        free_bytes);
+  return problems;
+}
+
+static void unlock_heap(alloc_heap_t *heap) {
+  if (heap->checking && check_locked(heap))
+    abort();
+  pthread_mutex_unlock(&heap->lock);
+}
+
+// Set while a thread builds its cache, whose pthread_setspecific may itself
+// allocate, and once the thread has flushed it on exit
+static __thread int cache_unavailable
+    __attribute__((tls_model("initial-exec")));
+
+// Hands n blocks of bin c back to the heap
+static void flush_bin(struct thread_cache *cache, int c, uint32_t n) {
+  alloc_heap_t *heap = cache->heap;
+  pthread_mutex_lock(&heap->lock);
+  for (; n > 0 && cache->bins[c]; n--) {
+    struct header *b = cache->bins[c];
+    cache->bins[c] = b->next;
+    cache->counts[c]--;
+    release_block(heap, b);
+  }
+  unlock_heap(heap);
+}
+
+static void destroy_thread_cache(void *arg) {
+  struct thread_cache *cache = arg;
+  cache_unavailable = 1;
+  for (int c = 0; c < CACHE_CLASSES; c++) {
+    if (cache->counts[c])
+      flush_bin(cache, c, cache->counts[c]);
+  }
+  alloc_heap_t *heap = cache->heap;
+  pthread_mutex_lock(&heap->lock);
+  release_block(heap, block_of(cache));
+  unlock_heap(heap);
+}
+
+// The calling thread's cache for heap, made on first use. The cache is
+// itself a block of the heap, so destroying the heap frees every cache.
+static struct thread_cache *thread_cache(alloc_heap_t *heap) {
+  if (!heap->caching)
+    return NULL;
+  struct thread_cache *cache = pthread_getspecific(heap->cache_key);
+  if (cache || cache_unavailable)
+    return cache;
+
+  cache_unavailable = 1;
+  pthread_mutex_lock(&heap->lock);
+  cache = malloc_locked(heap, sizeof(struct thread_cache));
+  unlock_heap(heap);
+  if (cache) {
+    memset(cache, 0, sizeof(struct thread_cache));
+    cache->heap = heap;
+    if (pthread_setspecific(heap->cache_key, cache) != 0) {
+      alloc_heap_free(heap, cache);
+      cache = NULL;
+    }
+  }
+  cache_unavailable = 0;
+  return cache;
+}
+
+// Fills empty bin c with CACHE_BATCH blocks carved out of one free block
+static struct header *refill_bin(struct thread_cache *cache, int c,
+                                 uint32_t *scanned) {
+  alloc_heap_t *heap = cache->heap;
+  size_t size = (size_t)(c + 2) * ALIGNMENT;
+  pthread_mutex_lock(&heap->lock);
+  heap->last_scan = 0;
+  struct header *b = find_fit(heap, size * CACHE_BATCH);
+  *scanned = heap->last_scan;
+  if (!b)
+    b = add_chunk(heap, size * CACHE_BATCH);
+  if (b) {
+    place(heap, b, size * CACHE_BATCH);
+    // The last block keeps any slack place() left too small to split off
+    size_t last = block_size(b) - (CACHE_BATCH - 1) * size;
+    b->size = size | ALLOCATED | (b->size & PREV_ALLOCATED);
+    struct header *prev = b;
+    for (int i = 1; i < CACHE_BATCH; i++) {
+      struct header *next = (struct header *)((char *)prev + size);
+      next->size = (i + 1 < CACHE_BATCH ? size : last) | ALLOCATED |
+                   PREV_ALLOCATED;
+      prev->next = next;
+      prev = next;
+    }
+    prev->next = NULL;
+    cache->bins[c] = b;
+    cache->counts[c] = CACHE_BATCH;
+  }
+  unlock_heap(heap);
+  return b;
+}
+
+static uint32_t trace_threads;
+// Set while a thread sets up or tears down its trace buffer
+static __thread int trace_unavailable
+    __attribute__((tls_model("initial-exec")));
+
+static uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Appends the buffered records to the trace file with a single O_APPEND
+// write, so buffers of different threads never interleave mid-record
+static void flush_trace(struct trace_buffer *buffer) {
+  int saved_errno = errno;
+  const char *p = (const char *)buffer->records;
+  size_t left = buffer->count * sizeof(alloc_trace_record_t);
+  while (left > 0) {
+    ssize_t n = write(buffer->heap->trace_fd, p, left);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    p += n;
+    left -= (size_t)n;
+  }
+  buffer->count = 0;
+  errno = saved_errno;
+}
+
+static void destroy_trace_buffer(void *arg) {
+  struct trace_buffer *buffer = arg;
+  alloc_heap_t *heap = buffer->heap;
+  trace_unavailable = 1;
+  flush_trace(buffer);
+  pthread_mutex_lock(&heap->lock);
+  unmap_block(heap, buffer);
+  unlock_heap(heap);
+}
+
+// The calling thread's trace buffer for heap, mapped on first use as a
+// block of the heap like the thread caches
+static struct trace_buffer *trace_buffer(alloc_heap_t *heap) {
+  struct trace_buffer *buffer = pthread_getspecific(heap->trace_key);
+  if (buffer || trace_unavailable)
+    return buffer;
+
+  trace_unavailable = 1;
+  pthread_mutex_lock(&heap->lock);
+  buffer = map_block(heap, sizeof(struct trace_buffer), ALIGNMENT);
+  unlock_heap(heap);
+  if (buffer) {
+    buffer->heap = heap;
+    buffer->thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+    if (pthread_setspecific(heap->trace_key, buffer) != 0) {
+      pthread_mutex_lock(&heap->lock);
+      unmap_block(heap, buffer);
+      unlock_heap(heap);
+      buffer = NULL;
+    }
+  }
+  trace_unavailable = 0;
+  return buffer;
+}
+
+// Adds record to the calling thread's buffer, stamping it with the current
+// time unless the caller already has
+static void trace_call(alloc_heap_t *heap, alloc_trace_record_t record) {
+  struct trace_buffer *buffer = trace_buffer(heap);
+  if (!buffer)
+    return;
+  if (!record.time_ns)
+    record.time_ns = trace_now();
+  record.thread = buffer->thread;
+  buffer->records[buffer->count] = record;
+  if (++buffer->count == TRACE_RECORDS)
+    flush_trace(buffer);
+}
+
+static void flush_thread_trace(alloc_heap_t *heap) {
+  struct trace_buffer *buffer = pthread_getspecific(heap->trace_key);
+  if (buffer)
+    flush_trace(buffer);
+}
+
+int alloc_policy_from_name(const char *name) {
+  if (strcmp(name, "first") == 0)
+    return ALLOC_FIRST_FIT;
+  if (strcmp(name, "best") == 0)
+    return ALLOC_BEST_FIT;
+  if (strcmp(name, "worst") == 0)
+    return ALLOC_WORST_FIT;
+  return -1;
+}
+
+const char *alloc_policy_name(alloc_policy_t policy) {
+  static const char *names[] = {"first", "best", "worst"};
+  return names[policy];
+}
+
+alloc_heap_t *alloc_heap_create(alloc_policy_t policy) {
+  if (!page_size)
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+  alloc_heap_t *heap = mmap(NULL, sizeof(alloc_heap_t), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (heap == MAP_FAILED)
+    return NULL;
+  pthread_mutex_init(&heap->lock, NULL);
+  heap->policy = policy;
+  return heap;
+}
+
+int alloc_heap_enable_thread_cache(alloc_heap_t *heap) {
+  if (heap->checking)
+    return -1;
+  if (!heap->caching && pthread_key_create(&heap->cache_key,
+                                           destroy_thread_cache) != 0)
+    return -1;
+  heap->caching = 1;
+  return 0;
+}
+
+int alloc_heap_trace(alloc_heap_t *heap, const char *path) {
+  if (heap->tracing)
+    return -1;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                0644);
+  if (fd < 0)
+    return -1;
+  if (write(fd, ALLOC_TRACE_MAGIC, 8) != 8 ||
+      pthread_key_create(&heap->trace_key, destroy_trace_buffer) != 0) {
+    close(fd);
+    return -1;
+  }
+  heap->trace_fd = fd;
+  heap->tracing = 1;
+  return 0;
+}
+
+void alloc_heap_destroy(alloc_heap_t *heap) {
+  // Caches and trace buffers live in the heap's memory; deleting their keys
+  // keeps threads from flushing them on exit
+  if (heap->caching)
+    pthread_key_delete(heap->cache_key);
+  if (heap->tracing) {
+    flush_thread_trace(heap);
+    pthread_key_delete(heap->trace_key);
+    close(heap->trace_fd);
+  }
+  while (heap->chunks)
+    release_chunk(heap, heap->chunks);
+  while (heap->mappings) {
+    struct mapping *m = heap->mappings;
+    heap->mappings = m->next;
+    munmap(m, m->size);
+  }
+  pthread_mutex_destroy(&heap->lock);
+  munmap(heap, sizeof(alloc_heap_t));
+}
+
+// The entry points below take the call site to trace, which is the return
+// address of whichever public function the program called
+
+static void *heap_malloc(alloc_heap_t *heap, size_t size, void *site) {
+  void *ptr = NULL;
+  uint32_t scanned = 0;
+  struct thread_cache *cache;
+  if (size <= MAX_EXACT - WORD && (cache = thread_cache(heap))) {
+    int c = class_of(request_size(size));
+    struct header *b = cache->bins[c];
+    if (b || (b = refill_bin(cache, c, &scanned))) {
+      cache->bins[c] = b->next;
+      cache->counts[c]--;
+      ptr = payload(b);
+    }
+  } else {
+    pthread_mutex_lock(&heap->lock);
+    heap->last_scan = 0;
+    ptr = malloc_locked(heap, size);
+    scanned = heap->last_scan;
+    unlock_heap(heap);
+  }
+
+  if (heap->tracing)
+    trace_call(heap, (alloc_trace_record_t){
+                         .op = 'a',
+                         .site = (uintptr_t)site,
+                         .ptr = (uintptr_t)ptr,
+                         .size = size,
+                         .block_size = ptr ? block_size(block_of(ptr)) : 0,
+                         .scanned = scanned,
+                     });
+  if (!ptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+static void heap_free(alloc_heap_t *heap, void *ptr, void *site) {
+  if (!ptr)
+    return;
+  // Mapped blocks are far too big to pass the cache's size test
+  struct header *b = block_of(ptr);
+  if (heap->tracing)
+    trace_call(heap, (alloc_trace_record_t){
+                         .op = 'f',
+                         .site = (uintptr_t)site,
+                         .ptr = (uintptr_t)ptr,
+                         .block_size = block_size(b),
+                     });
+
+  struct thread_cache *cache;
+  if (block_size(b) <= MAX_EXACT && (cache = thread_cache(heap))) {
+    int c = class_of(block_size(b));
+    b->next = cache->bins[c];
+    cache->bins[c] = b;
+    if (++cache->counts[c] >= CACHE_LIMIT)
+      flush_bin(cache, c, CACHE_BATCH);
+    return;
+  }
+
+  pthread_mutex_lock(&heap->lock);
+  free_locked(heap, ptr);
+  unlock_heap(heap);
+}
+
+static void *heap_realloc(alloc_heap_t *heap, void *ptr, size_t size,
+                          void *site) {
+  if (!ptr)
+    return heap_malloc(heap, size, site);
+  if (size == 0) {
+    heap_free(heap, ptr, site);
+    return NULL;
+  }
+  // Stamped before the call: once ptr is released another thread may get
+  // it back, and its record must come after this one
+  uint64_t start = heap->tracing ? trace_now() : 0;
+  pthread_mutex_lock(&heap->lock);
+  heap->last_scan = 0;
+  void *moved = realloc_locked(heap, ptr, size);
+  uint32_t scanned = heap->last_scan;
+  unlock_heap(heap);
+
+  if (heap->tracing)
+    trace_call(heap, (alloc_trace_record_t){
+                         .time_ns = start,
+                         .op = 'r',
+                         .site = (uintptr_t)site,
+                         .ptr = (uintptr_t)moved,
+                         .old_ptr = (uintptr_t)ptr,
+                         .size = size,
+                         .block_size = moved ? block_size(block_of(moved)) : 0,
+                         .scanned = scanned,
+                     });
+  if (!moved)
+    errno = ENOMEM;
+  return moved;
+}
+
+static void *heap_memalign(alloc_heap_t *heap, size_t alignment, size_t size,
+                           void *site) {
+  if (alignment & (alignment - 1)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  pthread_mutex_lock(&heap->lock);
+  heap->last_scan = 0;
+  void *ptr = memalign_locked(heap, alignment, size);
+  uint32_t scanned = heap->last_scan;
+  unlock_heap(heap);
+
+  if (heap->tracing)
+    trace_call(heap, (alloc_trace_record_t){
+                         .op = 'a',
+                         .site = (uintptr_t)site,
+                         .ptr = (uintptr_t)ptr,
+                         .size = size,
+                         .block_size = ptr ? block_size(block_of(ptr)) : 0,
+                         .scanned = scanned,
+                     });
+  if (!ptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+#define CALL_SITE __builtin_return_address(0)
+
+void *alloc_heap_malloc(alloc_heap_t *heap, size_t size) {
+  return heap_malloc(heap, size, CALL_SITE);
+}
+
+void alloc_heap_free(alloc_heap_t *heap, void *ptr) {
+  heap_free(heap, ptr, CALL_SITE);
+}
+
+void *alloc_heap_realloc(alloc_heap_t *heap, void *ptr, size_t size) {
+  return heap_realloc(heap, ptr, size, CALL_SITE);
+}
+
+void *alloc_heap_memalign(alloc_heap_t *heap, size_t alignment, size_t size) {
+  return heap_memalign(heap, alignment, size, CALL_SITE);
+}
+
+int alloc_heap_check(alloc_heap_t *heap) {
+  pthread_mutex_lock(&heap->lock);
+  int problems = check_locked(heap);
+  pthread_mutex_unlock(&heap->lock);
+  return problems;
+}
+
+void alloc_heap_stats(alloc_heap_t *heap, alloc_stats_t *stats) {
+  pthread_mutex_lock(&heap->lock);
+  *stats = heap->stats;
+  pthread_mutex_unlock(&heap->lock);
+}
+
+size_t alloc_usable_size(const void *ptr) {
+  size_t size = ((const size_t *)ptr)[-1];
+  if (size & MMAPPED) {
+    const char *end = (const char *)mapping_of(ptr) + (size & ~(size_t)FLAGS);
+    return (size_t)(end - (const char *)ptr);
+  }
+  return (size & ~(size_t)FLAGS) - WORD;
+}
+
+#ifndef ALLOC_NO_OVERRIDE
+// The process-wide heap behind malloc and friends. Its policy comes from
+// ALLOC_POLICY the first time it is used, which may be before main; setting
+// ALLOC_CHECK makes every call check the whole heap and abort on a problem,
+// and turns the thread caches off so that every call reaches the heap.
+// ALLOC_TRACE names a file to trace every call into; the records of threads
+// still running at exit are lost.
+static alloc_heap_t default_heap = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static int default_heap_ready;
+
+static alloc_heap_t *get_default_heap(void) {
+  if (!__atomic_load_n(&default_heap_ready, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&default_heap.lock);
+    if (!default_heap_ready) {
+      page_size = (size_t)sysconf(_SC_PAGESIZE);
+      const char *name = getenv("ALLOC_POLICY");
+      int policy = name ? alloc_policy_from_name(name) : -1;
+      default_heap.policy = policy < 0 ? ALLOC_FIRST_FIT : policy;
+      default_heap.checking = getenv("ALLOC_CHECK") != NULL;
+      alloc_heap_enable_thread_cache(&default_heap);
+      const char *trace = getenv("ALLOC_TRACE");
+      if (trace)
+        alloc_heap_trace(&default_heap, trace);
+      __atomic_store_n(&default_heap_ready, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&default_heap.lock);
+  }
+  return &default_heap;
+}
+
+// Keep the heap consistent across fork() in threaded programs
+static void lock_default_heap(void) { pthread_mutex_lock(&default_heap.lock); }
+
+static void unlock_default_heap(void) {
+  pthread_mutex_unlock(&default_heap.lock);
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void) {
+  get_default_heap();
+  pthread_atfork(lock_default_heap, unlock_default_heap, unlock_default_heap);
+}
+
+// Exiting runs no key destructors for the thread that calls exit()
+__attribute__((destructor)) static void flush_default_trace(void) {
+  if (default_heap.tracing)
+    flush_thread_trace(&default_heap);
+}
+
+void *malloc(size_t size) {
+  return heap_malloc(get_default_heap(), size, CALL_SITE);
+}
+
+void free(void *ptr) { heap_free(get_default_heap(), ptr, CALL_SITE); }
+
+void *calloc(size_t count, size_t size) {
+  if (size && count > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *ptr = heap_malloc(get_default_heap(), count * size, CALL_SITE);
+  // Fresh mappings are already zero
+  if (ptr && !(block_of(ptr)->size & MMAPPED))
+    memset(ptr, 0, count * size);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  return heap_realloc(get_default_heap(), ptr, size, CALL_SITE);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  return heap_memalign(get_default_heap(), alignment, size, CALL_SITE);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)))
+    return EINVAL;
+  void *ptr = heap_memalign(get_default_heap(), alignment, size, CALL_SITE);
+  if (!ptr)
+    return ENOMEM;
+  *out = ptr;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return heap_memalign(get_default_heap(), alignment, size, CALL_SITE);
+}
+
+void *valloc(size_t size) {
+  alloc_heap_t *heap = get_default_heap();
+  return heap_memalign(heap, page_size, size, CALL_SITE);
+}
+
+void *pvalloc(size_t size) {
+  alloc_heap_t *heap = get_default_heap();
+  return heap_memalign(heap, page_size, round_up(size, page_size), CALL_SITE);
+}
+
+size_t malloc_usable_size(void *ptr) {
+  return ptr ? alloc_usable_size(ptr) : 0;
+}
+#endif
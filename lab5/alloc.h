@@ -0,0 +1,79 @@
+// Segregated free-list allocator built on the fit strategies of lab5.c.
+//
+// Build as a malloc replacement:
+//   gcc -O2 -shared -fPIC -pthread -o liballoc.so alloc.c
+//   ALLOC_POLICY=best LD_PRELOAD=./liballoc.so ./program
+// or compile with -DALLOC_NO_OVERRIDE to link only the alloc_heap_* API.
+// ALLOC_TRACE=trace.bin records every call the program makes; replay the
+// trace with alloc_bench.
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  ALLOC_FIRST_FIT,
+  ALLOC_BEST_FIT,
+  ALLOC_WORST_FIT,
+} alloc_policy_t;
+
+typedef struct alloc_heap alloc_heap_t;
+
+typedef struct {
+  size_t mapped_bytes; // chunks and direct mappings obtained from the OS
+  size_t peak_mapped_bytes;
+  size_t allocated_bytes; // block sizes of live allocations, headers included
+  size_t free_bytes;      // bytes sitting on the free lists
+  size_t free_blocks;
+  size_t chunks;
+  size_t scanned_blocks; // free blocks looked at by all fit searches
+} alloc_stats_t;
+
+// A trace file is ALLOC_TRACE_MAGIC followed by records. Each thread writes
+// its records out in batches, so sort them by time_ns to interleave threads.
+#define ALLOC_TRACE_MAGIC "alloctr1"
+
+typedef struct {
+  uint64_t time_ns;    // CLOCK_MONOTONIC
+  uint64_t site;       // return address of the call into the allocator
+  uint64_t ptr;        // block returned or freed, 0 if allocation failed
+  uint64_t old_ptr;    // block passed to realloc
+  uint64_t size;       // bytes requested
+  uint64_t block_size; // of the block returned or freed, header included
+  uint32_t scanned;    // free blocks the fit search looked at
+  uint32_t thread;     // numbered in the order threads first call in
+  char op;             // 'a' allocate, 'r' reallocate or 'f' free
+  char pad[7];
+} alloc_trace_record_t;
+
+// Parses "first", "best" or "worst"; returns -1 for anything else
+int alloc_policy_from_name(const char *name);
+const char *alloc_policy_name(alloc_policy_t policy);
+
+alloc_heap_t *alloc_heap_create(alloc_policy_t policy);
+// Returns every chunk of the heap to the OS, live allocations included
+void alloc_heap_destroy(alloc_heap_t *heap);
+// Gives every thread that uses the heap its own cache of small blocks, so
+// most calls take no lock; blocks may still be freed on any thread. Call it
+// before the heap is shared. Returns -1 if no thread-specific key is left.
+int alloc_heap_enable_thread_cache(alloc_heap_t *heap);
+// Records every later call on the heap into per-thread buffers that are
+// appended to the file at path as they fill, when a thread exits and, for
+// the calling thread, when the heap is destroyed. Returns -1 if the file
+// cannot be created or the heap is already traced.
+int alloc_heap_trace(alloc_heap_t *heap, const char *path);
+
+void *alloc_heap_malloc(alloc_heap_t *heap, size_t size);
+void alloc_heap_free(alloc_heap_t *heap, void *ptr);
+void *alloc_heap_realloc(alloc_heap_t *heap, void *ptr, size_t size);
+// alignment must be a power of two
+void *alloc_heap_memalign(alloc_heap_t *heap, size_t alignment, size_t size);
+void alloc_heap_stats(alloc_heap_t *heap, alloc_stats_t *stats);
+// Checks every block and free list of the heap, describing each problem on
+// stderr. Returns the number of problems found, 0 for a consistent heap.
+int alloc_heap_check(alloc_heap_t *heap);
+
+size_t alloc_usable_size(const void *ptr);
+
+#endif
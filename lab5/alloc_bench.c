@@ -0,0 +1,933 @@
+// Replays allocation traces through each fit policy of alloc.c, and through
+// the address-ordered free list sketched at the bottom of lab5.c, and
+// reports how fast each one ran against how much memory it had to map.
+//
+//   gcc -O2 -pthread -DALLOC_NO_OVERRIDE -o alloc_bench alloc_bench.c alloc.c
+//   ./alloc_bench record <mixed|server|realloc> <ops> > trace.txt
+//   ./alloc_bench [-c] [trace.txt|trace.bin...]
+//   ./alloc_bench profile trace.bin
+//   ./alloc_bench threads [pairs] [messages]
+//
+// Without trace files the built-in workloads are recorded and replayed. A
+// trace has one operation per line: "a <id> <size>" allocates a block under
+// id, "r <id> <size>" reallocates it and "f <id>" frees it. Binary traces
+// written by ALLOC_TRACE are replayed too. -c runs the heap consistency
+// check every CHECK_INTERVAL operations of each replay.
+//
+// profile summarises a binary trace: how far the fit searches went and
+// which call sites allocate the most. Sites are return addresses; resolve
+// them with addr2line -e <program>, adjusted for where it was loaded.
+//
+// threads passes messages from producer to consumer threads as serverr.c
+// does, so every block is freed on a thread other than the one that
+// allocated it, and compares glibc malloc with the heap with and without
+// thread caches.
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "alloc.h"
+
+#define DEFAULT_OPS 1000000
+#define REPLAY_ROUNDS 3
+#define CHECK_INTERVAL 1000
+// Address space reserved for the free-list baseline; only touched pages
+// are backed by memory
+#define LIST_RESERVE ((size_t)1 << 36)
+#define LIST_MIN_BLOCK 32
+#define TOP_SITES 10
+#define DEFAULT_PAIRS 4
+#define DEFAULT_MESSAGES 1000000 // per producer
+// Producers queue messages in batches, so the queue lock costs little next
+// to the allocator
+#define QUEUE_BATCH 64
+#define QUEUE_LIMIT 4096
+
+typedef struct {
+  char op; // 'a', 'r' or 'f'
+  uint32_t id;
+  size_t size;
+} trace_op_t;
+
+typedef struct {
+  const char *name;
+  trace_op_t *ops;
+  size_t count;
+  size_t capacity;
+  uint32_t ids;     // one more than the largest id used
+  size_t peak_live; // most bytes requested and not yet freed at one time
+} trace_t;
+
+typedef struct {
+  double seconds;
+  size_t peak_mapped;
+  size_t scanned; // free blocks looked at by fit searches
+  int problems;   // found by the consistency check
+} replay_result_t;
+
+// The design at the bottom of lab5.c, as a baseline: a single free list kept
+// in address order and searched first-fit, whose free() walks the list to
+// the block's position before merging it with its neighbours
+typedef struct list_block {
+  size_t size; // of the whole block, header included
+  struct list_block *next;
+} list_block_t;
+
+typedef struct {
+  char *base;
+  size_t used; // bump pointer into the reservation
+  list_block_t *free_list;
+  size_t scanned;
+} list_heap_t;
+
+// The allocators a trace can be replayed through: the alloc.c policies,
+// then LIST_HEAP for the baseline
+#define LIST_HEAP (ALLOC_WORST_FIT + 1)
+
+static void trace_push(trace_t *trace, char op, uint32_t id, size_t size) {
+  if (trace->count == trace->capacity) {
+    trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+    trace->ops = realloc(trace->ops, trace->capacity * sizeof(trace_op_t));
+  }
+  trace->ops[trace->count++] = (trace_op_t){op, id, size};
+  if (id >= trace->ids)
+    trace->ids = id + 1;
+}
+
+// Works out peak_live by following the sizes of every id through the trace
+static void trace_finish(trace_t *trace) {
+  size_t *sizes = calloc(trace->ids + 1, sizeof(size_t));
+  size_t live = 0;
+  trace->peak_live = 0;
+  for (size_t i = 0; i < trace->count; i++) {
+    trace_op_t *op = &trace->ops[i];
+    live -= sizes[op->id];
+    sizes[op->id] = op->op == 'f' ? 0 : op->size;
+    live += sizes[op->id];
+    if (live > trace->peak_live)
+      trace->peak_live = live;
+  }
+  free(sizes);
+}
+
+// Orders records by time. Threads write their buffers out whole, so this
+// merges them back together; a thread never stamps two calls alike.
+static int compare_records(const void *a, const void *b) {
+  const alloc_trace_record_t *x = a, *y = b;
+  if (x->time_ns != y->time_ns)
+    return x->time_ns < y->time_ns ? -1 : 1;
+  return (x->thread > y->thread) - (x->thread < y->thread);
+}
+
+// Reads the records that follow the magic of a binary trace, in time order
+static alloc_trace_record_t *read_records(FILE *file, const char *path,
+                                          size_t *count) {
+  size_t capacity = 4096;
+  alloc_trace_record_t *records = malloc(capacity * sizeof(*records));
+  size_t n;
+  *count = 0;
+  while ((n = fread(records + *count, sizeof(*records), capacity - *count,
+                    file)) > 0) {
+    *count += n;
+    if (*count == capacity) {
+      capacity *= 2;
+      records = realloc(records, capacity * sizeof(*records));
+    }
+  }
+  if (ferror(file)) {
+    perror(path);
+    free(records);
+    return NULL;
+  }
+  qsort(records, *count, sizeof(*records), compare_records);
+  return records;
+}
+
+// Opens a binary trace and checks its magic
+static FILE *open_binary_trace(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return NULL;
+  }
+  char magic[8];
+  if (fread(magic, 1, 8, file) != 8 || memcmp(magic, ALLOC_TRACE_MAGIC, 8)) {
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+// The trace id of each live block address while converting a binary trace
+typedef struct {
+  uint64_t *keys; // 0 for an empty slot, 1 for a removed one
+  uint32_t *ids;
+  int bits;
+} ptr_map_t;
+
+#define NO_SLOT SIZE_MAX
+
+static size_t ptr_hash(const ptr_map_t *map, uint64_t ptr) {
+  return (size_t)((ptr * 0x9e3779b97f4a7c15ull) >> (64 - map->bits));
+}
+
+static size_t ptr_map_find(const ptr_map_t *map, uint64_t ptr) {
+  size_t mask = ((size_t)1 << map->bits) - 1;
+  for (size_t i = ptr_hash(map, ptr); map->keys[i]; i = (i + 1) & mask) {
+    if (map->keys[i] == ptr)
+      return i;
+  }
+  return NO_SLOT;
+}
+
+// Every insertion takes a fresh slot, so the map must have room for all of
+// them; see trace_from_records
+static void ptr_map_put(ptr_map_t *map, uint64_t ptr, uint32_t id) {
+  size_t mask = ((size_t)1 << map->bits) - 1;
+  size_t i = ptr_hash(map, ptr);
+  while (map->keys[i])
+    i = (i + 1) & mask;
+  map->keys[i] = ptr;
+  map->ids[i] = id;
+}
+
+// Frees whatever block the trace still has at ptr. Finding one means the
+// program freed it without the trace seeing, or before it began.
+static void forget_block(trace_t *trace, ptr_map_t *map, uint64_t ptr) {
+  size_t slot = ptr_map_find(map, ptr);
+  if (slot != NO_SLOT) {
+    trace_push(trace, 'f', map->ids[slot], 0);
+    map->keys[slot] = 1;
+  }
+}
+
+// Turns the block addresses of a binary trace into ids. Blocks allocated
+// before tracing began are ignored when freed, and become new blocks when
+// reallocated.
+static void trace_from_records(trace_t *trace,
+                               const alloc_trace_record_t *records,
+                               size_t count) {
+  ptr_map_t map = {.bits = 4};
+  while (((size_t)1 << map.bits) < 2 * count)
+    map.bits++;
+  map.keys = calloc((size_t)1 << map.bits, sizeof(uint64_t));
+  map.ids = malloc(((size_t)1 << map.bits) * sizeof(uint32_t));
+  uint32_t next_id = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    const alloc_trace_record_t *r = &records[i];
+    size_t slot;
+    switch (r->op) {
+    case 'a':
+      if (!r->ptr)
+        break;
+      forget_block(trace, &map, r->ptr);
+      ptr_map_put(&map, r->ptr, next_id);
+      trace_push(trace, 'a', next_id++, r->size);
+      break;
+    case 'r':
+      if (!r->ptr) // a failed realloc leaves the block as it was
+        break;
+      slot = ptr_map_find(&map, r->old_ptr);
+      if (slot == NO_SLOT) {
+        forget_block(trace, &map, r->ptr);
+        ptr_map_put(&map, r->ptr, next_id);
+        trace_push(trace, 'a', next_id++, r->size);
+        break;
+      }
+      uint32_t id = map.ids[slot];
+      map.keys[slot] = 1;
+      forget_block(trace, &map, r->ptr);
+      ptr_map_put(&map, r->ptr, id);
+      trace_push(trace, 'r', id, r->size);
+      break;
+    case 'f':
+      slot = ptr_map_find(&map, r->ptr);
+      if (slot != NO_SLOT) {
+        trace_push(trace, 'f', map.ids[slot], 0);
+        map.keys[slot] = 1;
+      }
+      break;
+    }
+  }
+  free(map.keys);
+  free(map.ids);
+}
+
+static int load_trace(const char *path, trace_t *trace) {
+  *trace = (trace_t){.name = path};
+  FILE *file = open_binary_trace(path);
+  if (file) {
+    size_t count;
+    alloc_trace_record_t *records = read_records(file, path, &count);
+    fclose(file);
+    if (!records)
+      return -1;
+    trace_from_records(trace, records, count);
+    free(records);
+    trace_finish(trace);
+    return 0;
+  }
+
+  file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+  char op;
+  unsigned id;
+  size_t size = 0;
+  while (fscanf(file, " %c %u", &op, &id) == 2) {
+    if ((op == 'a' || op == 'r') && fscanf(file, "%zu", &size) != 1)
+      break;
+    if (op != 'a' && op != 'r' && op != 'f') {
+      fprintf(stderr, "%s: unknown operation '%c'\n", path, op);
+      fclose(file);
+      return -1;
+    }
+    trace_push(trace, op, id, op == 'f' ? 0 : size);
+  }
+  fclose(file);
+  trace_finish(trace);
+  return 0;
+}
+
+typedef struct {
+  uint64_t site;
+  size_t calls;
+  size_t bytes;
+} site_stats_t;
+
+static int compare_sites(const void *a, const void *b) {
+  const site_stats_t *x = a, *y = b;
+  return (x->site > y->site) - (x->site < y->site);
+}
+
+static int compare_site_calls(const void *a, const void *b) {
+  const site_stats_t *x = a, *y = b;
+  return (x->calls < y->calls) - (x->calls > y->calls);
+}
+
+static int profile_trace(const char *path) {
+  FILE *file = open_binary_trace(path);
+  if (!file) {
+    fprintf(stderr, "%s: not a binary allocation trace\n", path);
+    return 1;
+  }
+  size_t count;
+  alloc_trace_record_t *records = read_records(file, path, &count);
+  fclose(file);
+  if (!records)
+    return 1;
+
+  size_t ops[3] = {0}, searches = 0, scanned = 0, max_scanned = 0;
+  uint32_t threads = 0;
+  site_stats_t *sites = malloc((count + 1) * sizeof(site_stats_t));
+  size_t site_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    const alloc_trace_record_t *r = &records[i];
+    ops[r->op == 'a' ? 0 : r->op == 'r' ? 1 : 2]++;
+    if (r->thread >= threads)
+      threads = r->thread + 1;
+    if (r->op == 'f')
+      continue;
+    searches++;
+    scanned += r->scanned;
+    if (r->scanned > max_scanned)
+      max_scanned = r->scanned;
+    sites[site_count++] = (site_stats_t){r->site, 1, r->size};
+  }
+
+  // Sort by site to add each site's calls up, then by calls
+  qsort(sites, site_count, sizeof(site_stats_t), compare_sites);
+  size_t unique = 0;
+  for (size_t i = 0; i < site_count; i++) {
+    if (unique && sites[unique - 1].site == sites[i].site) {
+      sites[unique - 1].calls++;
+      sites[unique - 1].bytes += sites[i].bytes;
+    } else {
+      sites[unique++] = sites[i];
+    }
+  }
+  qsort(sites, unique, sizeof(site_stats_t), compare_site_calls);
+
+  double seconds =
+      count ? (records[count - 1].time_ns - records[0].time_ns) / 1e9 : 0;
+  printf("%s: %zu calls from %u threads over %.3f s\n", path, count, threads,
+         seconds);
+  printf("%zu allocations, %zu reallocations, %zu frees\n", ops[0], ops[1],
+         ops[2]);
+  printf("fit searches looked at %.2f free blocks per call, at most %zu\n\n",
+         searches ? (double)scanned / searches : 0.0, max_scanned);
+  printf("%-20s%-12s%-12s%s\n", "Site", "Calls", "KiB", "Mean size");
+  for (size_t i = 0; i < unique && i < TOP_SITES; i++) {
+    printf("%#-20llx%-12zu%-12zu%zu\n", (unsigned long long)sites[i].site,
+           sites[i].calls, sites[i].bytes / 1024,
+           sites[i].bytes / sites[i].calls);
+  }
+  free(sites);
+  free(records);
+  return 0;
+}
+
+static uint32_t next_random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// Mostly small blocks with a long tail, freed in random order
+static size_t random_size(uint32_t *rng) {
+  uint32_t r = next_random(rng) % 100;
+  if (r < 70)
+    return 16 + next_random(rng) % 112;
+  if (r < 95)
+    return 128 + next_random(rng) % 3968;
+  return 4096 + next_random(rng) % 61440;
+}
+
+typedef struct {
+  uint32_t *ids;
+  size_t count;
+} live_set_t;
+
+static void live_add(live_set_t *live, uint32_t id) {
+  live->ids[live->count++] = id;
+}
+
+static uint32_t live_take(live_set_t *live, uint32_t *rng) {
+  size_t i = next_random(rng) % live->count;
+  uint32_t id = live->ids[i];
+  live->ids[i] = live->ids[--live->count];
+  return id;
+}
+
+// A long-running program: a live set of about ten thousand blocks
+static void record_mixed(trace_t *trace, size_t ops, uint32_t *rng) {
+  live_set_t live = {malloc(ops * sizeof(uint32_t)), 0};
+  uint32_t next_id = 0;
+  while (trace->count < ops) {
+    if (live.count < 10000 && (live.count == 0 || next_random(rng) % 2)) {
+      trace_push(trace, 'a', next_id, random_size(rng));
+      live_add(&live, next_id++);
+    } else {
+      trace_push(trace, 'f', live_take(&live, rng), 0);
+    }
+  }
+  free(live.ids);
+}
+
+// A request-handling server: every request allocates a burst of blocks and
+// frees them in reverse order, except for the odd one that outlives it
+static void record_server(trace_t *trace, size_t ops, uint32_t *rng) {
+  live_set_t kept = {malloc(ops * sizeof(uint32_t)), 0};
+  uint32_t *request = malloc(64 * sizeof(uint32_t));
+  uint32_t next_id = 0;
+  while (trace->count < ops) {
+    size_t n = 4 + next_random(rng) % 60;
+    size_t held = 0;
+    for (size_t i = 0; i < n; i++) {
+      trace_push(trace, 'a', next_id, random_size(rng));
+      if (next_random(rng) % 20 == 0)
+        live_add(&kept, next_id++);
+      else
+        request[held++] = next_id++;
+    }
+    while (held > 0)
+      trace_push(trace, 'f', request[--held], 0);
+    while (kept.count > 2000)
+      trace_push(trace, 'f', live_take(&kept, rng), 0);
+  }
+  free(request);
+  free(kept.ids);
+}
+
+// Buffers built up by repeated growth, like strings and vectors
+static void record_realloc(trace_t *trace, size_t ops, uint32_t *rng) {
+  live_set_t live = {malloc(ops * sizeof(uint32_t)), 0};
+  size_t *sizes = calloc(ops, sizeof(size_t));
+  uint32_t next_id = 0;
+  while (trace->count < ops) {
+    uint32_t r = next_random(rng) % 10;
+    if (live.count == 0 || (r < 3 && live.count < 5000)) {
+      sizes[next_id] = 16 + next_random(rng) % 64;
+      trace_push(trace, 'a', next_id, sizes[next_id]);
+      live_add(&live, next_id++);
+    } else if (r < 8) {
+      uint32_t id = live.ids[next_random(rng) % live.count];
+      sizes[id] += sizes[id] / 2 + 1;
+      if (sizes[id] > (1 << 20))
+        sizes[id] = 16;
+      trace_push(trace, 'r', id, sizes[id]);
+    } else {
+      trace_push(trace, 'f', live_take(&live, rng), 0);
+    }
+  }
+  free(sizes);
+  free(live.ids);
+}
+
+static int record_workload(const char *kind, size_t ops, trace_t *trace) {
+  uint32_t rng = 2463534242u;
+  *trace = (trace_t){.name = kind};
+  if (strcmp(kind, "mixed") == 0)
+    record_mixed(trace, ops, &rng);
+  else if (strcmp(kind, "server") == 0)
+    record_server(trace, ops, &rng);
+  else if (strcmp(kind, "realloc") == 0)
+    record_realloc(trace, ops, &rng);
+  else
+    return -1;
+  trace_finish(trace);
+  return 0;
+}
+
+static list_heap_t *list_create(void) {
+  list_heap_t *heap = calloc(1, sizeof(list_heap_t));
+  heap->base = mmap(NULL, LIST_RESERVE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (heap->base == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return heap;
+}
+
+static void list_destroy(list_heap_t *heap) {
+  munmap(heap->base, LIST_RESERVE);
+  free(heap);
+}
+
+static void *list_malloc(list_heap_t *heap, size_t size) {
+  size_t need = (size + sizeof(list_block_t) + 15) & ~(size_t)15;
+  list_block_t *prev = NULL;
+  for (list_block_t *b = heap->free_list; b; prev = b, b = b->next) {
+    heap->scanned++;
+    if (b->size < need)
+      continue;
+    list_block_t *rest = b->next;
+    if (b->size - need >= LIST_MIN_BLOCK) {
+      rest = (list_block_t *)((char *)b + need);
+      rest->size = b->size - need;
+      rest->next = b->next;
+      b->size = need;
+    }
+    if (prev)
+      prev->next = rest;
+    else
+      heap->free_list = rest;
+    return b + 1;
+  }
+
+  if (size > LIST_RESERVE || need > LIST_RESERVE - heap->used) {
+    fprintf(stderr, "list baseline: out of its %zu byte reserve\n",
+            LIST_RESERVE);
+    exit(1);
+  }
+  list_block_t *b = (list_block_t *)(heap->base + heap->used);
+  heap->used += need;
+  b->size = need;
+  return b + 1;
+}
+
+// Ignores NULL, as free does, since a trace may free an id it never
+// allocated
+static void list_free(list_heap_t *heap, void *ptr) {
+  if (!ptr)
+    return;
+  list_block_t *block = (list_block_t *)ptr - 1;
+  list_block_t *prev = NULL;
+  list_block_t *curr = heap->free_list;
+  while (curr && curr < block) {
+    prev = curr;
+    curr = curr->next;
+  }
+
+  block->next = curr;
+  if (prev)
+    prev->next = block;
+  else
+    heap->free_list = block;
+
+  if (curr && (char *)block + block->size == (char *)curr) {
+    block->size += curr->size;
+    block->next = curr->next;
+  }
+  if (prev && (char *)prev + prev->size == (char *)block) {
+    prev->size += block->size;
+    prev->next = block->next;
+  }
+}
+
+static void *list_realloc(list_heap_t *heap, void *ptr, size_t size) {
+  if (!ptr)
+    return list_malloc(heap, size);
+  size_t old = ((list_block_t *)ptr - 1)->size - sizeof(list_block_t);
+  if (size <= old)
+    return ptr;
+  void *moved = list_malloc(heap, size);
+  memcpy(moved, ptr, old);
+  list_free(heap, ptr);
+  return moved;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void replay_list(const trace_t *trace, replay_result_t *result) {
+  list_heap_t *heap = list_create();
+  void **blocks = calloc(trace->ids, sizeof(void *));
+
+  double start = now_seconds();
+  for (size_t i = 0; i < trace->count; i++) {
+    const trace_op_t *op = &trace->ops[i];
+    switch (op->op) {
+    case 'a':
+      blocks[op->id] = list_malloc(heap, op->size);
+      if (blocks[op->id])
+        *(char *)blocks[op->id] = 1;
+      break;
+    case 'r':
+      blocks[op->id] = list_realloc(heap, blocks[op->id], op->size);
+      break;
+    default:
+      list_free(heap, blocks[op->id]);
+      blocks[op->id] = NULL;
+    }
+  }
+  result->seconds = now_seconds() - start;
+  result->peak_mapped = heap->used;
+  result->scanned = heap->scanned;
+  result->problems = 0;
+
+  free(blocks);
+  list_destroy(heap);
+}
+
+static void replay(const trace_t *trace, int allocator, int check,
+                   replay_result_t *result) {
+  if (allocator == LIST_HEAP) {
+    replay_list(trace, result);
+    return;
+  }
+  alloc_heap_t *heap = alloc_heap_create(allocator);
+  void **blocks = calloc(trace->ids, sizeof(void *));
+  result->problems = 0;
+
+  double start = now_seconds();
+  for (size_t i = 0; i < trace->count; i++) {
+    const trace_op_t *op = &trace->ops[i];
+    switch (op->op) {
+    case 'a':
+      blocks[op->id] = alloc_heap_malloc(heap, op->size);
+      if (blocks[op->id])
+        *(char *)blocks[op->id] = 1; // touch it as a program would
+      break;
+    case 'r':
+      blocks[op->id] = alloc_heap_realloc(heap, blocks[op->id], op->size);
+      break;
+    default:
+      alloc_heap_free(heap, blocks[op->id]);
+      blocks[op->id] = NULL;
+    }
+    if (check && i % CHECK_INTERVAL == 0)
+      result->problems += alloc_heap_check(heap);
+  }
+  result->seconds = now_seconds() - start;
+
+  for (uint32_t id = 0; id < trace->ids; id++)
+    alloc_heap_free(heap, blocks[id]);
+  if (check)
+    result->problems += alloc_heap_check(heap);
+  alloc_stats_t stats;
+  alloc_heap_stats(heap, &stats);
+  result->peak_mapped = stats.peak_mapped_bytes;
+  result->scanned = stats.scanned_blocks;
+
+  free(blocks);
+  alloc_heap_destroy(heap);
+}
+
+// Allocator under test in the threaded benchmark; heap is NULL for glibc
+typedef struct {
+  const char *name;
+  alloc_heap_t *heap;
+} thread_allocator_t;
+
+typedef struct message {
+  struct message *next;
+  size_t length;
+  char text[];
+} message_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  message_t *head;
+  message_t *tail;
+  size_t count;
+  int done;
+} message_queue_t;
+
+typedef struct {
+  const thread_allocator_t *allocator;
+  message_queue_t *queue;
+  size_t messages;
+  uint32_t rng;
+} pair_args_t;
+
+static void *bench_alloc(const thread_allocator_t *allocator, size_t size) {
+  return allocator->heap ? alloc_heap_malloc(allocator->heap, size)
+                         : malloc(size);
+}
+
+static void bench_free(const thread_allocator_t *allocator, void *ptr) {
+  if (allocator->heap)
+    alloc_heap_free(allocator->heap, ptr);
+  else
+    free(ptr);
+}
+
+// Appends a batch of count messages, waiting while the queue is full
+static void queue_push(message_queue_t *queue, message_t *head,
+                       message_t *tail, size_t count) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count >= QUEUE_LIMIT)
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  if (queue->tail)
+    queue->tail->next = head;
+  else
+    queue->head = head;
+  queue->tail = tail;
+  queue->count += count;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Takes every queued message, or NULL once the producer is done
+static message_t *queue_take_all(message_queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (!queue->head && !queue->done)
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  message_t *head = queue->head;
+  queue->head = queue->tail = NULL;
+  queue->count = 0;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+  return head;
+}
+
+static void *run_producer(void *arg) {
+  pair_args_t *args = arg;
+  message_t *head = NULL, *tail = NULL;
+  size_t batched = 0;
+  for (size_t i = 0; i < args->messages; i++) {
+    size_t length = 16 + next_random(&args->rng) % 240;
+    message_t *m = bench_alloc(args->allocator, sizeof(message_t) + length);
+    m->next = NULL;
+    m->length = length;
+    memset(m->text, 'm', length);
+    if (tail)
+      tail->next = m;
+    else
+      head = m;
+    tail = m;
+    if (++batched == QUEUE_BATCH || i + 1 == args->messages) {
+      queue_push(args->queue, head, tail, batched);
+      head = tail = NULL;
+      batched = 0;
+    }
+  }
+
+  pthread_mutex_lock(&args->queue->lock);
+  args->queue->done = 1;
+  pthread_cond_broadcast(&args->queue->changed);
+  pthread_mutex_unlock(&args->queue->lock);
+  return NULL;
+}
+
+static void *run_consumer(void *arg) {
+  pair_args_t *args = arg;
+  message_t *m;
+  while ((m = queue_take_all(args->queue))) {
+    while (m) {
+      message_t *next = m->next;
+      if (m->text[m->length - 1] != 'm') {
+        fprintf(stderr, "message %p was overwritten\n", (void *)m);
+        abort();
+      }
+      bench_free(args->allocator, m);
+      m = next;
+    }
+  }
+  return NULL;
+}
+
+// Runs pairs producer/consumer pairs and returns the elapsed seconds
+static double run_pairs(const thread_allocator_t *allocator, int pairs,
+                        size_t messages) {
+  message_queue_t *queues = calloc(pairs, sizeof(message_queue_t));
+  pair_args_t *args = calloc(pairs, sizeof(pair_args_t));
+  pthread_t *threads = calloc(2 * pairs, sizeof(pthread_t));
+
+  double start = now_seconds();
+  for (int i = 0; i < pairs; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    pthread_cond_init(&queues[i].changed, NULL);
+    args[i] = (pair_args_t){allocator, &queues[i], messages, 2463534242u + i};
+    pthread_create(&threads[2 * i], NULL, run_producer, &args[i]);
+    pthread_create(&threads[2 * i + 1], NULL, run_consumer, &args[i]);
+  }
+  for (int i = 0; i < 2 * pairs; i++)
+    pthread_join(threads[i], NULL);
+  double seconds = now_seconds() - start;
+
+  for (int i = 0; i < pairs; i++) {
+    pthread_mutex_destroy(&queues[i].lock);
+    pthread_cond_destroy(&queues[i].changed);
+  }
+  free(threads);
+  free(args);
+  free(queues);
+  return seconds;
+}
+
+static int report_threads(int pairs, size_t messages) {
+  printf("%d producer/consumer pairs, %zu messages each\n", pairs, messages);
+  printf("%-16s%-12s%s\n", "Allocator", "Mmsg/s", "Peak mapped KiB");
+  alloc_heap_t *heaps[2];
+  thread_allocator_t allocators[3] = {{"glibc", NULL}};
+  for (int i = 0; i < 2; i++) {
+    heaps[i] = alloc_heap_create(ALLOC_BEST_FIT);
+    if (!heaps[i] ||
+        (i == 1 && alloc_heap_enable_thread_cache(heaps[i]) != 0)) {
+      fprintf(stderr, "cannot create a heap\n");
+      return 1;
+    }
+    allocators[i + 1] =
+        (thread_allocator_t){i ? "heap+cache" : "heap", heaps[i]};
+  }
+
+  for (int i = 0; i < 3; i++) {
+    double best = 0;
+    for (int round = 0; round < REPLAY_ROUNDS; round++) {
+      double seconds = run_pairs(&allocators[i], pairs, messages);
+      if (round == 0 || seconds < best)
+        best = seconds;
+    }
+    printf("%-16s%-12.1f", allocators[i].name,
+           (double)pairs * messages / best / 1e6);
+    if (allocators[i].heap) {
+      alloc_stats_t stats;
+      alloc_heap_stats(allocators[i].heap, &stats);
+      printf("%zu\n", stats.peak_mapped_bytes / 1024);
+    } else {
+      printf("-\n");
+    }
+  }
+  for (int i = 0; i < 2; i++)
+    alloc_heap_destroy(heaps[i]);
+  return 0;
+}
+
+// Returns the number of heap problems found, if checking
+static int report(const trace_t *trace, int check) {
+  printf("%s: %zu ops, peak live %zu KiB\n", trace->name, trace->count,
+         trace->peak_live / 1024);
+  printf("%-8s%-12s%-16s%-10s%s\n", "Policy", "Mops/s", "Peak mapped KiB",
+         "Overhead", "Scanned/alloc");
+  size_t allocs = 0;
+  for (size_t i = 0; i < trace->count; i++)
+    allocs += trace->ops[i].op != 'f';
+  int problems = 0;
+  for (int allocator = ALLOC_FIRST_FIT; allocator <= LIST_HEAP; allocator++) {
+    replay_result_t best = {0};
+    for (int round = 0; round < REPLAY_ROUNDS; round++) {
+      replay_result_t result;
+      replay(trace, allocator, check, &result);
+      problems += result.problems;
+      if (round == 0 || result.seconds < best.seconds)
+        best = result;
+    }
+    size_t peak = best.peak_mapped;
+    char overhead[32];
+    snprintf(overhead, sizeof(overhead), "%.1f%%",
+             trace->peak_live
+                 ? 100.0 * ((double)peak / trace->peak_live - 1)
+                 : 0.0);
+    printf("%-8s%-12.1f%-16zu%-10s%.2f\n",
+           allocator == LIST_HEAP ? "list" : alloc_policy_name(allocator),
+           trace->count / best.seconds / 1e6, peak / 1024, overhead,
+           allocs ? (double)best.scanned / allocs : 0.0);
+  }
+  if (check)
+    printf("%d heap problems\n", problems);
+  printf("\n");
+  return problems;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 3 && strcmp(argv[1], "record") == 0) {
+    trace_t trace;
+    size_t ops = argc > 3 ? strtoull(argv[3], NULL, 10) : DEFAULT_OPS;
+    if (record_workload(argv[2], ops, &trace) != 0) {
+      fprintf(stderr, "unknown workload %s\n", argv[2]);
+      return 1;
+    }
+    for (size_t i = 0; i < trace.count; i++) {
+      const trace_op_t *op = &trace.ops[i];
+      if (op->op == 'f')
+        printf("f %u\n", op->id);
+      else
+        printf("%c %u %zu\n", op->op, op->id, op->size);
+    }
+    free(trace.ops);
+    return 0;
+  }
+
+  if (argc == 3 && strcmp(argv[1], "profile") == 0)
+    return profile_trace(argv[2]);
+
+  if (argc >= 2 && strcmp(argv[1], "threads") == 0) {
+    int pairs = argc > 2 ? atoi(argv[2]) : DEFAULT_PAIRS;
+    size_t messages = argc > 3 ? strtoull(argv[3], NULL, 10)
+                               : DEFAULT_MESSAGES;
+    if (pairs < 1) {
+      fprintf(stderr, "need at least one pair\n");
+      return 1;
+    }
+    return report_threads(pairs, messages);
+  }
+
+  int check = argc > 1 && strcmp(argv[1], "-c") == 0;
+  int first = check ? 2 : 1;
+  int problems = 0;
+  if (first == argc) {
+    const char *kinds[] = {"mixed", "server", "realloc"};
+    for (int i = 0; i < 3; i++) {
+      trace_t trace;
+      record_workload(kinds[i], DEFAULT_OPS, &trace);
+      problems += report(&trace, check);
+      free(trace.ops);
+    }
+    return problems != 0;
+  }
+
+  for (int i = first; i < argc; i++) {
+    trace_t trace;
+    if (load_trace(argv[i], &trace) != 0)
+      return 1;
+    problems += report(&trace, check);
+    free(trace.ops);
+  }
+  return problems != 0;
+}
@@ -109,4 +109,8 @@ if (curr != NULL and end_of(newly_freed_block) == start_of(curr)):
 if (prev != NULL and end_of(prev) == start_of(newly_freed_block)):
     prev->size += newly_freed_block->size
     prev->next = newly_freed_block->next
+
+alloc.c's release_block() does the same merge without the walk: footers
+and PREV_ALLOCATED bits find both neighbours directly, and doubly linked
+free lists let it unlink them in O(1).
 */
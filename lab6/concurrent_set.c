@@ -0,0 +1,264 @@
+#include "concurrent_set.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define CACHE_LINE 64
+// Replaced versions are freed in batches of this many, so most changes
+// skip the scan of the readers' epochs
+#define RECLAIM_BATCH 16
+
+// A published snapshot. Once replaced it waits on the retired list,
+// tagged with the epoch it was replaced in.
+struct version {
+  sorted_set_t *snapshot;
+  uint64_t epoch;
+  struct version *next;
+};
+
+// One per thread that has read the set. epoch is 0 between reads and
+// otherwise the set's epoch when the read began. It is written on every
+// read, so each reader gets a cache line to itself.
+struct reader {
+  _Alignas(CACHE_LINE) _Atomic uint64_t epoch;
+  atomic_bool used;
+  struct reader *next;
+};
+
+struct concurrent_set {
+  pthread_mutex_t lock; // held by writers
+  sorted_set_t *set;    // shared, changed only under lock
+  _Atomic(struct version *) current;
+  _Atomic uint64_t epoch;
+  _Atomic(struct reader *) readers; // only ever pushed onto
+  pthread_key_t reader_key;
+  // Replaced versions, oldest first
+  struct version *retired;
+  struct version *retired_tail;
+  size_t retired_count;
+};
+
+// Readers of exiting threads are left for new threads to take over
+static void release_reader(void *arg) {
+  struct reader *reader = arg;
+  atomic_store(&reader->epoch, 0);
+  atomic_store(&reader->used, false);
+}
+
+// The calling thread's reader, or NULL if out of memory
+static struct reader *thread_reader(concurrent_set_t *set) {
+  struct reader *reader = pthread_getspecific(set->reader_key);
+  if (reader)
+    return reader;
+  for (reader = atomic_load(&set->readers); reader; reader = reader->next) {
+    bool used = false;
+    if (atomic_compare_exchange_strong(&reader->used, &used, true))
+      break;
+  }
+  if (!reader) {
+    reader = aligned_alloc(CACHE_LINE, sizeof(struct reader));
+    if (!reader)
+      return NULL;
+    atomic_init(&reader->epoch, 0);
+    atomic_init(&reader->used, true);
+    reader->next = atomic_load(&set->readers);
+    while (!atomic_compare_exchange_weak(&set->readers, &reader->next, reader))
+      ;
+  }
+  if (pthread_setspecific(set->reader_key, reader) != 0) {
+    release_reader(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+// Returns the snapshot to read until end_read. A thread that cannot get a
+// reader holds the writers' lock instead, and *reader is set to NULL.
+static const sorted_set_t *begin_read(concurrent_set_t *set,
+                                      struct reader **reader) {
+  *reader = thread_reader(set);
+  if (!*reader) {
+    pthread_mutex_lock(&set->lock);
+    return atomic_load(&set->current)->snapshot;
+  }
+  // The epoch is stored before the version is loaded, so a writer that
+  // replaces the version after this load sees the epoch
+  atomic_store(&(*reader)->epoch, atomic_load(&set->epoch));
+  return atomic_load(&set->current)->snapshot;
+}
+
+static void end_read(concurrent_set_t *set, struct reader *reader) {
+  if (reader)
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+  else
+    pthread_mutex_unlock(&set->lock);
+}
+
+static void free_version(struct version *version) {
+  sorted_set_release_snapshot(version->snapshot);
+  free(version);
+}
+
+// Frees the replaced versions no reader can still hold: those replaced
+// before the epoch of the oldest read in progress
+static void reclaim(concurrent_set_t *set) {
+  uint64_t oldest = UINT64_MAX;
+  for (struct reader *reader = atomic_load(&set->readers); reader;
+       reader = reader->next) {
+    uint64_t epoch = atomic_load(&reader->epoch);
+    if (epoch != 0 && epoch < oldest)
+      oldest = epoch;
+  }
+  while (set->retired && set->retired->epoch < oldest) {
+    struct version *version = set->retired;
+    set->retired = version->next;
+    set->retired_count--;
+    free_version(version);
+  }
+  if (!set->retired)
+    set->retired_tail = NULL;
+}
+
+// Publishes the writers' set as it is now, under the lock
+static void publish(concurrent_set_t *set, struct version *version) {
+  version->snapshot = sorted_set_snapshot(set->set);
+  if (!version->snapshot) {
+    free(version);
+    return;
+  }
+  struct version *old = atomic_exchange(&set->current, version);
+  old->epoch = atomic_fetch_add(&set->epoch, 1);
+  old->next = NULL;
+  if (set->retired_tail)
+    set->retired_tail->next = old;
+  else
+    set->retired = old;
+  set->retired_tail = old;
+  if (++set->retired_count >= RECLAIM_BATCH)
+    reclaim(set);
+}
+
+concurrent_set_t *concurrent_set_create(void) {
+  concurrent_set_t *set = malloc(sizeof(concurrent_set_t));
+  struct version *version = malloc(sizeof(struct version));
+  sorted_set_t *shared = sorted_set_create();
+  if (set && version && shared) {
+    sorted_set_share(shared);
+    version->snapshot = sorted_set_snapshot(shared);
+    if (version->snapshot &&
+        pthread_key_create(&set->reader_key, release_reader) == 0) {
+      pthread_mutex_init(&set->lock, NULL);
+      set->set = shared;
+      atomic_init(&set->current, version);
+      atomic_init(&set->epoch, 1);
+      atomic_init(&set->readers, NULL);
+      set->retired = NULL;
+      set->retired_tail = NULL;
+      set->retired_count = 0;
+      return set;
+    }
+    if (version->snapshot)
+      sorted_set_release_snapshot(version->snapshot);
+  }
+  if (shared)
+    sorted_set_destroy(shared);
+  free(version);
+  free(set);
+  return NULL;
+}
+
+void concurrent_set_destroy(concurrent_set_t *set) {
+  pthread_key_delete(set->reader_key);
+  struct reader *reader = atomic_load(&set->readers);
+  while (reader) {
+    struct reader *next = reader->next;
+    free(reader);
+    reader = next;
+  }
+  while (set->retired) {
+    struct version *next = set->retired->next;
+    free_version(set->retired);
+    set->retired = next;
+  }
+  free_version(atomic_load(&set->current));
+  sorted_set_destroy(set->set);
+  pthread_mutex_destroy(&set->lock);
+  free(set);
+}
+
+int concurrent_set_insert(concurrent_set_t *set, uint64_t key) {
+  struct version *version = malloc(sizeof(struct version));
+  if (!version)
+    return -1;
+  pthread_mutex_lock(&set->lock);
+  int status = sorted_set_insert(set->set, key);
+  if (status == 0)
+    publish(set, version);
+  else
+    free(version);
+  pthread_mutex_unlock(&set->lock);
+  return status;
+}
+
+int concurrent_set_insert_batch(concurrent_set_t *set, const uint64_t *keys,
+                                size_t n) {
+  struct version *version = malloc(sizeof(struct version));
+  if (!version)
+    return -1;
+  pthread_mutex_lock(&set->lock);
+  // Even a failed batch may have inserted some keys
+  int status = sorted_set_insert_batch(set->set, keys, n);
+  publish(set, version);
+  pthread_mutex_unlock(&set->lock);
+  return status;
+}
+
+int concurrent_set_remove(concurrent_set_t *set, uint64_t key) {
+  struct version *version = malloc(sizeof(struct version));
+  if (!version)
+    return -1;
+  pthread_mutex_lock(&set->lock);
+  int status = sorted_set_remove(set->set, key);
+  if (status == 1)
+    publish(set, version);
+  else
+    free(version);
+  pthread_mutex_unlock(&set->lock);
+  return status;
+}
+
+size_t concurrent_set_size(concurrent_set_t *set) {
+  struct reader *reader;
+  size_t size = sorted_set_size(begin_read(set, &reader));
+  end_read(set, reader);
+  return size;
+}
+
+bool concurrent_set_contains(concurrent_set_t *set, uint64_t key) {
+  struct reader *reader;
+  bool found = sorted_set_contains(begin_read(set, &reader), key);
+  end_read(set, reader);
+  return found;
+}
+
+size_t concurrent_set_rank(concurrent_set_t *set, uint64_t key) {
+  struct reader *reader;
+  size_t rank = sorted_set_rank(begin_read(set, &reader), key);
+  end_read(set, reader);
+  return rank;
+}
+
+int64_t concurrent_set_index_of(concurrent_set_t *set, uint64_t key) {
+  struct reader *reader;
+  int64_t index = sorted_set_index_of(begin_read(set, &reader), key);
+  end_read(set, reader);
+  return index;
+}
+
+void concurrent_set_read(concurrent_set_t *set, concurrent_set_read_t read,
+                         void *arg) {
+  struct reader *reader;
+  read(begin_read(set, &reader), arg);
+  end_read(set, reader);
+}
@@ -0,0 +1,40 @@
+// Sorted set that many threads may query while others change it. Queries
+// take no locks: they read an immutable snapshot of a copy-on-write
+// sorted_set_t. Changes take a mutex, copy the path they touch and publish
+// a new snapshot. Old snapshots are freed once every reader that could
+// hold one has moved on, which readers announce through per-thread epochs.
+//
+//   gcc -O2 -pthread -o example_2 example_2.c concurrent_set.c sorted_set.c
+#ifndef CONCURRENT_SET_H
+#define CONCURRENT_SET_H
+
+#include "sorted_set.h"
+
+typedef struct concurrent_set concurrent_set_t;
+
+typedef void (*concurrent_set_read_t)(const sorted_set_t *snapshot,
+                                      void *arg);
+
+// Returns NULL if out of memory
+concurrent_set_t *concurrent_set_create(void);
+// No other thread may be using the set
+void concurrent_set_destroy(concurrent_set_t *set);
+
+// As their sorted_set counterparts, returning -1 if out of memory
+int concurrent_set_insert(concurrent_set_t *set, uint64_t key);
+int concurrent_set_insert_batch(concurrent_set_t *set, const uint64_t *keys,
+                                size_t n);
+int concurrent_set_remove(concurrent_set_t *set, uint64_t key);
+
+size_t concurrent_set_size(concurrent_set_t *set);
+bool concurrent_set_contains(concurrent_set_t *set, uint64_t key);
+size_t concurrent_set_rank(concurrent_set_t *set, uint64_t key);
+int64_t concurrent_set_index_of(concurrent_set_t *set, uint64_t key);
+
+// Calls read on a snapshot that stays the same for the whole call, for
+// queries that have to agree with each other. read must not call back
+// into set.
+void concurrent_set_read(concurrent_set_t *set, concurrent_set_read_t read,
+                         void *arg);
+
+#endif
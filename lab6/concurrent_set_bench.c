@@ -0,0 +1,236 @@
+// Times a mix of index_of queries and changes on the concurrent set from a
+// growing number of threads, against a sorted set behind a mutex and one
+// behind a reader-writer lock.
+//
+//   gcc -O2 -pthread -o concurrent_set_bench concurrent_set_bench.c
+//       concurrent_set.c sorted_set.c
+//   ./concurrent_set_bench [keys] [write percent] [max threads]
+//
+// Each thread runs for RUN_SECONDS. A change inserts a random key or
+// removes one, so the set keeps its size.
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "concurrent_set.h"
+
+#define DEFAULT_KEYS 1000000
+#define DEFAULT_WRITE_PERCENT 10
+#define DEFAULT_MAX_THREADS 8
+#define RUN_SECONDS 0.5
+
+typedef struct locked_set {
+  pthread_mutex_t mutex;
+  pthread_rwlock_t rwlock;
+  bool use_rwlock;
+  sorted_set_t *set;
+} locked_set_t;
+
+typedef struct set_ops {
+  const char *name;
+  void *(*create)(const uint64_t *keys, size_t n);
+  void (*destroy)(void *set);
+  int64_t (*index_of)(void *set, uint64_t key);
+  void (*insert)(void *set, uint64_t key);
+  void (*remove)(void *set, uint64_t key);
+} set_ops_t;
+
+static void die(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+static locked_set_t *locked_create(const uint64_t *keys, size_t n,
+                                   bool use_rwlock) {
+  locked_set_t *locked = malloc(sizeof(locked_set_t));
+  if (!locked || !(locked->set = sorted_set_from_array(keys, n)))
+    die("sorted_set_from_array");
+  pthread_mutex_init(&locked->mutex, NULL);
+  pthread_rwlock_init(&locked->rwlock, NULL);
+  locked->use_rwlock = use_rwlock;
+  return locked;
+}
+
+static void *mutex_create(const uint64_t *keys, size_t n) {
+  return locked_create(keys, n, false);
+}
+
+static void *rwlock_create(const uint64_t *keys, size_t n) {
+  return locked_create(keys, n, true);
+}
+
+static void locked_destroy(void *arg) {
+  locked_set_t *locked = arg;
+  sorted_set_destroy(locked->set);
+  pthread_mutex_destroy(&locked->mutex);
+  pthread_rwlock_destroy(&locked->rwlock);
+  free(locked);
+}
+
+static void lock(locked_set_t *locked, bool write) {
+  if (!locked->use_rwlock)
+    pthread_mutex_lock(&locked->mutex);
+  else if (write)
+    pthread_rwlock_wrlock(&locked->rwlock);
+  else
+    pthread_rwlock_rdlock(&locked->rwlock);
+}
+
+static void unlock(locked_set_t *locked) {
+  if (locked->use_rwlock)
+    pthread_rwlock_unlock(&locked->rwlock);
+  else
+    pthread_mutex_unlock(&locked->mutex);
+}
+
+static int64_t locked_index_of(void *arg, uint64_t key) {
+  locked_set_t *locked = arg;
+  lock(locked, false);
+  int64_t index = sorted_set_index_of(locked->set, key);
+  unlock(locked);
+  return index;
+}
+
+static void locked_insert(void *arg, uint64_t key) {
+  locked_set_t *locked = arg;
+  lock(locked, true);
+  if (sorted_set_insert(locked->set, key) != 0)
+    die("sorted_set_insert");
+  unlock(locked);
+}
+
+static void locked_remove(void *arg, uint64_t key) {
+  locked_set_t *locked = arg;
+  lock(locked, true);
+  sorted_set_remove(locked->set, key);
+  unlock(locked);
+}
+
+static void *concurrent_create(const uint64_t *keys, size_t n) {
+  concurrent_set_t *set = concurrent_set_create();
+  if (!set || concurrent_set_insert_batch(set, keys, n) != 0)
+    die("concurrent_set_create");
+  return set;
+}
+
+static void concurrent_destroy(void *set) { concurrent_set_destroy(set); }
+
+static int64_t concurrent_index_of(void *set, uint64_t key) {
+  return concurrent_set_index_of(set, key);
+}
+
+static void concurrent_insert(void *set, uint64_t key) {
+  if (concurrent_set_insert(set, key) != 0)
+    die("concurrent_set_insert");
+}
+
+static void concurrent_remove(void *set, uint64_t key) {
+  if (concurrent_set_remove(set, key) < 0)
+    die("concurrent_set_remove");
+}
+
+static const set_ops_t sets[] = {
+    {"mutex", mutex_create, locked_destroy, locked_index_of, locked_insert,
+     locked_remove},
+    {"rwlock", rwlock_create, locked_destroy, locked_index_of, locked_insert,
+     locked_remove},
+    {"concurrent", concurrent_create, concurrent_destroy, concurrent_index_of,
+     concurrent_insert, concurrent_remove},
+};
+
+typedef struct worker_args {
+  const set_ops_t *ops;
+  void *set;
+  const uint64_t *keys;
+  size_t n;
+  int write_percent;
+  uint64_t seed;
+  atomic_bool *stop;
+  long done;
+} worker_args_t;
+
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static void *run_worker(void *arg) {
+  worker_args_t *args = arg;
+  uint64_t rng = args->seed;
+  long done = 0;
+  while (!atomic_load_explicit(args->stop, memory_order_relaxed)) {
+    uint64_t r = next_random(&rng);
+    uint64_t key = args->keys[r % args->n];
+    if ((int)(r >> 57) * 100 < args->write_percent * 128) {
+      if (r & (1ull << 56))
+        args->ops->insert(args->set, key);
+      else
+        args->ops->remove(args->set, key);
+    } else {
+      args->ops->index_of(args->set, key);
+    }
+    done++;
+  }
+  args->done = done;
+  return NULL;
+}
+
+// Millions of operations a second across all threads
+static double run(const set_ops_t *ops, const uint64_t *keys, size_t n,
+                  int threads, int write_percent) {
+  void *set = ops->create(keys, n);
+  atomic_bool stop = false;
+  pthread_t tids[threads];
+  worker_args_t args[threads];
+  for (int i = 0; i < threads; i++) {
+    args[i] = (worker_args_t){ops,           set,   keys, n,
+                              write_percent, i + 1, &stop, 0};
+    if (pthread_create(&tids[i], NULL, run_worker, &args[i]) != 0)
+      die("pthread_create");
+  }
+  struct timespec pause = {0, (long)(RUN_SECONDS * 1e9)};
+  nanosleep(&pause, NULL);
+  atomic_store(&stop, true);
+  long done = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], NULL);
+    done += args[i].done;
+  }
+  ops->destroy(set);
+  return (double)done / RUN_SECONDS / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_KEYS;
+  int write_percent = argc > 2 ? atoi(argv[2]) : DEFAULT_WRITE_PERCENT;
+  int max_threads = argc > 3 ? atoi(argv[3]) : DEFAULT_MAX_THREADS;
+  uint64_t *keys = malloc(n * sizeof(uint64_t));
+  if (!keys || n == 0)
+    die("keys");
+  uint64_t rng = 88172645463325252ull;
+  for (size_t i = 0; i < n; i++)
+    keys[i] = next_random(&rng);
+
+  printf("%zu keys, %d%% writes, %ld CPUs, Mops/s\n", n, write_percent,
+         sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-8s", "Threads");
+  for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+    printf("%-12s", sets[s].name);
+  printf("\n");
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    printf("%-8d", threads);
+    for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); s++) {
+      printf("%-12.2f", run(&sets[s], keys, n, threads, write_percent));
+      fflush(stdout);
+    }
+    printf("\n");
+  }
+  free(keys);
+  return 0;
+}
@@ -1,8 +1,11 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "concurrent_set.h"
+
 #define ASSERT(expr)                                                           \
   {                                                                            \
     if (!(expr)) {                                                             \
@@ -21,45 +24,29 @@
     }                                                                          \
   }
 
-typedef struct node {
-  uint64_t data;
-  struct node *next;
-} node_t;
-
-node_t *head = NULL;
+// Any number of threads may insert and look up keys at once
+concurrent_set_t *set = NULL;
+pthread_once_t set_once = PTHREAD_ONCE_INIT;
 
-void insert_sorted(uint64_t data) {
-  node_t *new_node = malloc(sizeof(node_t));
-  new_node->data = data;
-  new_node->next = NULL;
+static void create_set(void) { set = concurrent_set_create(); }
 
-  if (head == NULL || data < head->data) {
-    new_node->next = head;
-    head = new_node;
-    return;
-  }
+static concurrent_set_t *get_set(void) {
+  pthread_once(&set_once, create_set);
+  return set;
+}
 
-  node_t *curr = head;
-  while (curr->next != NULL && curr->next->data < data) {
-    curr = curr->next;
+void insert_sorted(uint64_t data) {
+  if (get_set() == NULL || concurrent_set_insert(set, data) != 0) {
+    perror("insert_sorted");
+    exit(1);
   }
-
-  new_node->next = curr->next;
-  curr->next = new_node;
 }
 
 int index_of(uint64_t data) {
-  node_t *curr = head;
-  int index = 0;
-
-  while (curr != NULL) {
-    if (curr->data == data) {
-      return index;
-    }
-    curr = curr->next;
-    index++;
+  if (get_set() == NULL) {
+    return -1;
   }
-  return -1;
+  return (int)concurrent_set_index_of(set, data);
 }
 
 int main() {
@@ -1,9 +1,12 @@
 // example_1.c
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "concurrent_set.h"
+
 #define ASSERT(expr)                                                           \
   {                                                                            \
     if (!(expr)) {                                                             \
@@ -22,45 +25,29 @@
     }                                                                          \
   }
 
-typedef struct node {
-  uint64_t data;
-  struct node *next;
-} node_t;
+// Any number of threads may insert and look up keys at once
+concurrent_set_t *set = NULL;
+pthread_once_t set_once = PTHREAD_ONCE_INIT;
 
-node_t *head = NULL;
+static void create_set(void) { set = concurrent_set_create(); }
 
-void insert_sorted(uint64_t data) {
-  node_t *new_node = malloc(sizeof(node_t));
-  new_node->data = data;
-  new_node->next = NULL;
-
-  if (head == NULL || data < head->data) {
-    new_node->next = head;
-    head = new_node;
-    return;
-  }
+static concurrent_set_t *get_set(void) {
+  pthread_once(&set_once, create_set);
+  return set;
+}
 
-  node_t *curr = head;
-  while (curr->next != NULL && curr->next->data < data) {
-    curr = curr->next;
+void insert_sorted(uint64_t data) {
+  if (get_set() == NULL || concurrent_set_insert(set, data) != 0) {
+    perror("insert_sorted");
+    exit(1);
   }
-
-  new_node->next = curr->next;
-  curr->next = new_node;
 }
 
 int index_of(uint64_t data) {
-  node_t *curr = head;
-  int index = 0;
-
-  while (curr != NULL) {
-    if (curr->data == data) {
-      return index;
-    }
-    curr = curr->next;
-    index++;
+  if (get_set() == NULL) {
+    return -1;
   }
-  return -1;
+  return (int)concurrent_set_index_of(set, data);
 }
 
 int main() {
@@ -80,10 +67,13 @@ int main() {
 }
 
 // example_2.c
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "concurrent_set.h"
+
 #define ASSERT(expr)                                                           \
   {                                                                            \
     if (!(expr)) {                                                             \
@@ -101,60 +91,54 @@ int main() {
     }                                                                          \
   }
 
-typedef struct node {
-  uint64_t data;
-  struct node *next;
-} node_t;
-
 typedef struct info {
-  uint64_t sum;
+  _Atomic uint64_t sum;
 } info_t;
 
-node_t *head = NULL;
+// Any number of threads may insert, remove and look up keys at once
+concurrent_set_t *set = NULL;
+pthread_once_t set_once = PTHREAD_ONCE_INIT;
 info_t info = {0};
 
+static void create_set(void) { set = concurrent_set_create(); }
+
+static concurrent_set_t *get_set(void) {
+  pthread_once(&set_once, create_set);
+  return set;
+}
+
 void insert_sorted(uint64_t data) {
-  node_t *new_node = malloc(sizeof(node_t));
-  new_node->data = data;
-  new_node->next = NULL;
-
-  if (head == NULL || data < head->data) {
-    new_node->next = head;
-    head = new_node;
-  } else {
-    node_t *curr = head;
-    while (curr->next != NULL && curr->next->data < data) {
-      curr = curr->next;
-    }
-    new_node->next = curr->next;
-    curr->next = new_node;
+  if (get_set() == NULL || concurrent_set_insert(set, data) != 0) {
+    perror("insert_sorted");
+    exit(1);
   }
 
   info.sum += data;
 }
 
+void remove_sorted(uint64_t data) {
+  if (get_set() != NULL && concurrent_set_remove(set, data) == 1) {
+    info.sum -= data;
+  }
+}
+
+static void read_sum(const sorted_set_t *snapshot, void *sum) {
+  *(uint64_t *)sum = sorted_set_sum(snapshot);
+}
+
 uint64_t sum_list() {
-  uint64_t total = 0;
-  node_t *curr = head;
-  while (curr != NULL) {
-    total += curr->data;
-    curr = curr->next;
+  uint64_t sum = 0;
+  if (get_set() != NULL) {
+    concurrent_set_read(set, read_sum, &sum);
   }
-  return total;
+  return sum;
 }
 
 int index_of(uint64_t data) {
-  node_t *curr = head;
-  int index = 0;
-
-  while (curr != NULL) {
-    if (curr->data == data) {
-      return index;
-    }
-    curr = curr->next;
-    index++;
+  if (get_set() == NULL) {
+    return -1;
   }
-  return -1;
+  return (int)concurrent_set_index_of(set, data);
 }
 
 int main() {
@@ -168,5 +152,9 @@ int main() {
   // Side property check
   ASSERT(info.sum == sum_list());
 
+  remove_sorted(3);
+  TEST(index_of(5) == 2);
+  ASSERT(info.sum == sum_list());
+
   return 0;
 }
@@ -0,0 +1,927 @@
+#include "sorted_set.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A leaf of 64 keys fills eight cache lines. Each node has room for one
+// entry more than it may keep, so an insert can overflow it and then split.
+#define LEAF_KEYS 64
+#define FANOUT 32
+// Inner nodes have at least FANOUT / 2 children and leaves LEAF_KEYS / 2
+// keys, so 2^64 keys fit well within this many levels
+#define MAX_HEIGHT 16
+// Batches smaller than this fraction of the set are inserted key by key;
+// bigger ones are merged with the set's keys into a freshly built tree
+#define MERGE_FRACTION 32
+// Shorter arrays are sorted by insertion rather than by radix
+#define RADIX_MIN 64
+
+// Every node starts with a link so that a shared set can chain the nodes
+// it has replaced until they are freed
+struct leaf {
+  void *next_retired;
+  uint32_t count;
+  uint64_t keys[LEAF_KEYS + 1];
+};
+
+// keys[i] separates children[i] from children[i + 1]: no key below the
+// former is greater and none below the latter is less. counts[i] is the
+// number of keys below children[i] and sums[i] their sum.
+struct inner {
+  void *next_retired;
+  uint32_t count; // children
+  uint64_t keys[FANOUT];
+  void *children[FANOUT + 1];
+  size_t counts[FANOUT + 1];
+  uint64_t sums[FANOUT + 1];
+};
+
+// Leaves are at height 0. Only an empty set has an empty leaf. Sums wrap
+// modulo 2^64.
+struct sorted_set {
+  void *root;
+  int height;
+  size_t size;
+  uint64_t sum;
+  // Nodes allocated ahead for the next change: a leaf and one inner node
+  // per level above it for the splits of an insert, the last one for a
+  // new root, and in a shared set as many again for copies of the path
+  // and the snapshot that will show the change. With these in hand a
+  // change cannot fail half done.
+  struct leaf *spare_leaves[2];
+  int spare_leaf_count;
+  struct inner *spare_inners[2 * MAX_HEIGHT + 2];
+  int spare_inner_count;
+  sorted_set_t *spare_snapshot;
+  bool shared;
+  // Nodes replaced since the last snapshot; in a snapshot, those replaced
+  // before it was taken
+  void *retired;
+};
+
+// First position in keys[0, n) holding a key not less than key
+static uint32_t lower_bound(const uint64_t *keys, uint32_t n, uint64_t key) {
+  uint32_t lo = 0;
+  while (n > 0) {
+    uint32_t half = n / 2;
+    if (keys[lo + half] < key) {
+      lo += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  return lo;
+}
+
+// First position in keys[0, n) holding a key greater than key
+static uint32_t upper_bound(const uint64_t *keys, uint32_t n, uint64_t key) {
+  uint32_t lo = 0;
+  while (n > 0) {
+    uint32_t half = n / 2;
+    if (keys[lo + half] <= key) {
+      lo += half + 1;
+      n -= half + 1;
+    } else {
+      n = half;
+    }
+  }
+  return lo;
+}
+
+static size_t node_size(const void *node, int height) {
+  if (height == 0)
+    return ((const struct leaf *)node)->count;
+  const struct inner *inner = node;
+  size_t size = 0;
+  for (uint32_t i = 0; i < inner->count; i++)
+    size += inner->counts[i];
+  return size;
+}
+
+static uint64_t node_sum(const void *node, int height) {
+  uint64_t sum = 0;
+  if (height == 0) {
+    const struct leaf *leaf = node;
+    for (uint32_t i = 0; i < leaf->count; i++)
+      sum += leaf->keys[i];
+    return sum;
+  }
+  const struct inner *inner = node;
+  for (uint32_t i = 0; i < inner->count; i++)
+    sum += inner->sums[i];
+  return sum;
+}
+
+static void free_node(void *node, int height) {
+  if (height > 0) {
+    struct inner *inner = node;
+    for (uint32_t i = 0; i < inner->count; i++)
+      free_node(inner->children[i], height - 1);
+  }
+  free(node);
+}
+
+static void free_retired(void *node) {
+  while (node) {
+    void *next = *(void **)node;
+    free(node);
+    node = next;
+  }
+}
+
+static void init_set(sorted_set_t *set) {
+  set->spare_leaf_count = 0;
+  set->spare_inner_count = 0;
+  set->spare_snapshot = NULL;
+  set->shared = false;
+  set->retired = NULL;
+}
+
+sorted_set_t *sorted_set_create(void) {
+  sorted_set_t *set = malloc(sizeof(sorted_set_t));
+  if (!set)
+    return NULL;
+  set->root = calloc(1, sizeof(struct leaf));
+  if (!set->root) {
+    free(set);
+    return NULL;
+  }
+  set->height = 0;
+  set->size = 0;
+  set->sum = 0;
+  init_set(set);
+  return set;
+}
+
+void sorted_set_destroy(sorted_set_t *set) {
+  free_node(set->root, set->height);
+  while (set->spare_leaf_count > 0)
+    free(set->spare_leaves[--set->spare_leaf_count]);
+  while (set->spare_inner_count > 0)
+    free(set->spare_inners[--set->spare_inner_count]);
+  free(set->spare_snapshot);
+  free_retired(set->retired);
+  free(set);
+}
+
+static int reserve_nodes(sorted_set_t *set) {
+  int leaves = set->shared ? 2 : 1;
+  int inners = set->shared ? 2 * set->height + 1 : set->height + 1;
+  while (set->spare_leaf_count < leaves) {
+    struct leaf *leaf = malloc(sizeof(struct leaf));
+    if (!leaf)
+      return -1;
+    set->spare_leaves[set->spare_leaf_count++] = leaf;
+  }
+  while (set->spare_inner_count < inners) {
+    struct inner *inner = malloc(sizeof(struct inner));
+    if (!inner)
+      return -1;
+    set->spare_inners[set->spare_inner_count++] = inner;
+  }
+  if (set->shared && !set->spare_snapshot &&
+      !(set->spare_snapshot = malloc(sizeof(sorted_set_t))))
+    return -1;
+  return 0;
+}
+
+static struct leaf *take_leaf(sorted_set_t *set) {
+  return set->spare_leaves[--set->spare_leaf_count];
+}
+
+static struct inner *take_inner(sorted_set_t *set) {
+  return set->spare_inners[--set->spare_inner_count];
+}
+
+// A shared set keeps the nodes it stops using until its next snapshot
+static void release_node(sorted_set_t *set, void *node) {
+  if (!set->shared) {
+    free(node);
+    return;
+  }
+  *(void **)node = set->retired;
+  set->retired = node;
+}
+
+static void release_tree(sorted_set_t *set, void *node, int height) {
+  if (!set->shared) {
+    free_node(node, height);
+    return;
+  }
+  if (height > 0) {
+    struct inner *inner = node;
+    for (uint32_t i = 0; i < inner->count; i++)
+      release_tree(set, inner->children[i], height - 1);
+  }
+  release_node(set, node);
+}
+
+// Returns the node in *slot, ready to be changed. A shared set changes a
+// copy instead, since snapshots may be reading the original.
+static void *own_node(sorted_set_t *set, void **slot, int height) {
+  if (!set->shared)
+    return *slot;
+  void *copy;
+  if (height == 0) {
+    copy = take_leaf(set);
+    memcpy(copy, *slot, sizeof(struct leaf));
+  } else {
+    copy = take_inner(set);
+    memcpy(copy, *slot, sizeof(struct inner));
+  }
+  release_node(set, *slot);
+  return *slot = copy;
+}
+
+// Moves the upper half of an overflowing leaf into right
+static void split_leaf(struct leaf *leaf, struct leaf *right,
+                       uint64_t *separator) {
+  uint32_t keep = leaf->count / 2;
+  right->count = leaf->count - keep;
+  memcpy(right->keys, leaf->keys + keep, right->count * sizeof(uint64_t));
+  leaf->count = keep;
+  *separator = right->keys[0];
+}
+
+static void split_inner(struct inner *inner, struct inner *right,
+                        uint64_t *separator) {
+  uint32_t keep = inner->count / 2;
+  right->count = inner->count - keep;
+  memcpy(right->keys, inner->keys + keep,
+         (right->count - 1) * sizeof(uint64_t));
+  memcpy(right->children, inner->children + keep,
+         right->count * sizeof(void *));
+  memcpy(right->counts, inner->counts + keep, right->count * sizeof(size_t));
+  memcpy(right->sums, inner->sums + keep, right->count * sizeof(uint64_t));
+  *separator = inner->keys[keep - 1];
+  inner->count = keep;
+}
+
+// Inserts key below the node in *slot. If the node splits, returns its
+// new right sibling and sets *separator.
+static void *insert_into(sorted_set_t *set, void **slot, int height,
+                         uint64_t key, uint64_t *separator) {
+  void *node = own_node(set, slot, height);
+  if (height == 0) {
+    struct leaf *leaf = node;
+    uint32_t pos = upper_bound(leaf->keys, leaf->count, key);
+    memmove(leaf->keys + pos + 1, leaf->keys + pos,
+            (leaf->count - pos) * sizeof(uint64_t));
+    leaf->keys[pos] = key;
+    if (++leaf->count <= LEAF_KEYS)
+      return NULL;
+    struct leaf *right = take_leaf(set);
+    split_leaf(leaf, right, separator);
+    return right;
+  }
+
+  struct inner *inner = node;
+  uint32_t i = upper_bound(inner->keys, inner->count - 1, key);
+  uint64_t child_separator;
+  void *child_right = insert_into(set, &inner->children[i], height - 1, key,
+                                  &child_separator);
+  inner->counts[i]++;
+  inner->sums[i] += key;
+  if (!child_right)
+    return NULL;
+
+  size_t moved = node_size(child_right, height - 1);
+  uint64_t moved_sum = node_sum(child_right, height - 1);
+  inner->counts[i] -= moved;
+  inner->sums[i] -= moved_sum;
+  uint32_t n = inner->count;
+  memmove(inner->keys + i + 1, inner->keys + i,
+          (n - 1 - i) * sizeof(uint64_t));
+  memmove(inner->children + i + 2, inner->children + i + 1,
+          (n - 1 - i) * sizeof(void *));
+  memmove(inner->counts + i + 2, inner->counts + i + 1,
+          (n - 1 - i) * sizeof(size_t));
+  memmove(inner->sums + i + 2, inner->sums + i + 1,
+          (n - 1 - i) * sizeof(uint64_t));
+  inner->keys[i] = child_separator;
+  inner->children[i + 1] = child_right;
+  inner->counts[i + 1] = moved;
+  inner->sums[i + 1] = moved_sum;
+  if (++inner->count <= FANOUT)
+    return NULL;
+  struct inner *right = take_inner(set);
+  split_inner(inner, right, separator);
+  return right;
+}
+
+int sorted_set_insert(sorted_set_t *set, uint64_t key) {
+  if (reserve_nodes(set) != 0)
+    return -1;
+  uint64_t separator;
+  void *right = insert_into(set, &set->root, set->height, key, &separator);
+  set->size++;
+  set->sum += key;
+  if (!right)
+    return 0;
+
+  struct inner *root = take_inner(set);
+  root->count = 2;
+  root->keys[0] = separator;
+  root->children[0] = set->root;
+  root->children[1] = right;
+  root->counts[1] = node_size(right, set->height);
+  root->counts[0] = set->size - root->counts[1];
+  root->sums[1] = node_sum(right, set->height);
+  root->sums[0] = set->sum - root->sums[1];
+  set->root = root;
+  set->height++;
+  return 0;
+}
+
+// Evens out the keys of leaves left and right, or moves them all into left
+// when it can hold them, returning true if so
+static bool rebalance_leaves(struct leaf *left, struct leaf *right,
+                             uint64_t *separator) {
+  uint32_t total = left->count + right->count;
+  uint32_t keep = total <= LEAF_KEYS ? total : total / 2;
+  if (left->count > keep) {
+    uint32_t move = left->count - keep;
+    memmove(right->keys + move, right->keys, right->count * sizeof(uint64_t));
+    memcpy(right->keys, left->keys + keep, move * sizeof(uint64_t));
+  } else {
+    uint32_t move = keep - left->count;
+    memcpy(left->keys + left->count, right->keys, move * sizeof(uint64_t));
+    memmove(right->keys, right->keys + move,
+            (right->count - move) * sizeof(uint64_t));
+  }
+  left->count = keep;
+  right->count = total - keep;
+  if (right->count > 0)
+    *separator = right->keys[0];
+  return right->count == 0;
+}
+
+// As rebalance_leaves for inner nodes, where *separator, the parent's key
+// between them, moves down into left or right with the children that cross
+static bool rebalance_inners(struct inner *left, struct inner *right,
+                             uint64_t *separator) {
+  uint64_t keys[2 * FANOUT];
+  void *children[2 * FANOUT];
+  size_t counts[2 * FANOUT];
+  uint64_t sums[2 * FANOUT];
+  uint32_t total = left->count + right->count;
+  memcpy(keys, left->keys, (left->count - 1) * sizeof(uint64_t));
+  keys[left->count - 1] = *separator;
+  memcpy(keys + left->count, right->keys,
+         (right->count - 1) * sizeof(uint64_t));
+  memcpy(children, left->children, left->count * sizeof(void *));
+  memcpy(children + left->count, right->children,
+         right->count * sizeof(void *));
+  memcpy(counts, left->counts, left->count * sizeof(size_t));
+  memcpy(counts + left->count, right->counts, right->count * sizeof(size_t));
+  memcpy(sums, left->sums, left->count * sizeof(uint64_t));
+  memcpy(sums + left->count, right->sums, right->count * sizeof(uint64_t));
+
+  uint32_t keep = total <= FANOUT ? total : total / 2;
+  left->count = keep;
+  right->count = total - keep;
+  memcpy(left->keys, keys, (keep - 1) * sizeof(uint64_t));
+  memcpy(left->children, children, keep * sizeof(void *));
+  memcpy(left->counts, counts, keep * sizeof(size_t));
+  memcpy(left->sums, sums, keep * sizeof(uint64_t));
+  if (right->count > 0) {
+    *separator = keys[keep - 1];
+    memcpy(right->keys, keys + keep,
+           (right->count - 1) * sizeof(uint64_t));
+    memcpy(right->children, children + keep, right->count * sizeof(void *));
+    memcpy(right->counts, counts + keep, right->count * sizeof(size_t));
+    memcpy(right->sums, sums + keep, right->count * sizeof(uint64_t));
+  }
+  return right->count == 0;
+}
+
+// Refills child i of inner, which has fallen below half full, from a
+// sibling: the two share their entries out evenly, or merge if one node
+// can hold them all
+static void refill_child(sorted_set_t *set, struct inner *inner, uint32_t i,
+                         int height) {
+  uint32_t l = i > 0 ? i - 1 : i;
+  own_node(set, &inner->children[i > 0 ? i - 1 : i + 1], height);
+  void *left = inner->children[l], *right = inner->children[l + 1];
+  bool merged = height == 0
+                    ? rebalance_leaves(left, right, &inner->keys[l])
+                    : rebalance_inners(left, right, &inner->keys[l]);
+  size_t total = inner->counts[l] + inner->counts[l + 1];
+  uint64_t sum = inner->sums[l] + inner->sums[l + 1];
+  if (!merged) {
+    inner->counts[l] = node_size(left, height);
+    inner->sums[l] = node_sum(left, height);
+    inner->counts[l + 1] = total - inner->counts[l];
+    inner->sums[l + 1] = sum - inner->sums[l];
+    return;
+  }
+
+  release_node(set, right);
+  uint32_t n = inner->count;
+  memmove(inner->keys + l, inner->keys + l + 1,
+          (n - 2 - l) * sizeof(uint64_t));
+  memmove(inner->children + l + 1, inner->children + l + 2,
+          (n - 2 - l) * sizeof(void *));
+  memmove(inner->counts + l + 1, inner->counts + l + 2,
+          (n - 2 - l) * sizeof(size_t));
+  memmove(inner->sums + l + 1, inner->sums + l + 2,
+          (n - 2 - l) * sizeof(uint64_t));
+  inner->counts[l] = total;
+  inner->sums[l] = sum;
+  inner->count--;
+}
+
+// Removes the key at position index below the node in *slot and returns it
+static uint64_t remove_at(sorted_set_t *set, void **slot, int height,
+                          size_t index) {
+  void *node = own_node(set, slot, height);
+  if (height == 0) {
+    struct leaf *leaf = node;
+    uint64_t key = leaf->keys[index];
+    memmove(leaf->keys + index, leaf->keys + index + 1,
+            (leaf->count - index - 1) * sizeof(uint64_t));
+    leaf->count--;
+    return key;
+  }
+
+  struct inner *inner = node;
+  uint32_t i = 0;
+  while (index >= inner->counts[i]) {
+    index -= inner->counts[i];
+    i++;
+  }
+  uint64_t key = remove_at(set, &inner->children[i], height - 1, index);
+  inner->counts[i]--;
+  inner->sums[i] -= key;
+  bool underfull =
+      height == 1
+          ? ((struct leaf *)inner->children[i])->count < LEAF_KEYS / 2
+          : ((struct inner *)inner->children[i])->count < FANOUT / 2;
+  if (underfull)
+    refill_child(set, inner, i, height - 1);
+  return key;
+}
+
+int sorted_set_remove_at(sorted_set_t *set, size_t index, uint64_t *key) {
+  if (set->shared && reserve_nodes(set) != 0)
+    return -1;
+  uint64_t removed = remove_at(set, &set->root, set->height, index);
+  set->size--;
+  set->sum -= removed;
+  if (set->height > 0 && ((struct inner *)set->root)->count == 1) {
+    struct inner *root = set->root;
+    set->root = root->children[0];
+    set->height--;
+    release_node(set, root);
+  }
+  if (key)
+    *key = removed;
+  return 0;
+}
+
+// Sorts keys in eight byte-wide counting passes, least significant first,
+// using tmp as scratch. Passes over a byte that every key shares are
+// skipped, so keys from a small range take few passes.
+static void radix_sort(uint64_t *keys, uint64_t *tmp, size_t n) {
+  if (n < RADIX_MIN) {
+    for (size_t i = 1; i < n; i++) {
+      uint64_t key = keys[i];
+      size_t j = i;
+      for (; j > 0 && keys[j - 1] > key; j--)
+        keys[j] = keys[j - 1];
+      keys[j] = key;
+    }
+    return;
+  }
+
+  size_t counts[8][256] = {{0}};
+  for (size_t i = 0; i < n; i++) {
+    for (int b = 0; b < 8; b++)
+      counts[b][(keys[i] >> (8 * b)) & 0xff]++;
+  }
+
+  uint64_t *from = keys, *to = tmp;
+  for (int b = 0; b < 8; b++) {
+    if (counts[b][(keys[0] >> (8 * b)) & 0xff] == n)
+      continue;
+    size_t offset = 0;
+    for (int d = 0; d < 256; d++) {
+      size_t count = counts[b][d];
+      counts[b][d] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < n; i++)
+      to[counts[b][(from[i] >> (8 * b)) & 0xff]++] = from[i];
+    uint64_t *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != keys)
+    memcpy(keys, from, n * sizeof(uint64_t));
+}
+
+// Builds a tree over sorted keys. Each level is split into as few nodes as
+// will hold it, sharing its entries out evenly, so every node is at least
+// half full. All nodes are allocated before any is filled in, so nothing
+// is left behind on failure.
+static int build_tree(const uint64_t *keys, size_t n, void **root,
+                      int *height) {
+  size_t level_nodes[MAX_HEIGHT + 1];
+  size_t nodes = n ? (n + LEAF_KEYS - 1) / LEAF_KEYS : 1;
+  size_t total = nodes;
+  int top = 0;
+  level_nodes[0] = nodes;
+  while (nodes > 1) {
+    nodes = (nodes + FANOUT - 1) / FANOUT;
+    level_nodes[++top] = nodes;
+    total += nodes;
+  }
+
+  void **pool = malloc(total * sizeof(void *));
+  // Entries of the level being built on: node, key count, key sum and
+  // first key
+  void **below = malloc(level_nodes[0] * sizeof(void *));
+  size_t *sizes = malloc(level_nodes[0] * sizeof(size_t));
+  uint64_t *sums = malloc(level_nodes[0] * sizeof(uint64_t));
+  uint64_t *lows = malloc(level_nodes[0] * sizeof(uint64_t));
+  // Leaves come first in the pool, then each level of inner nodes
+  size_t allocated = 0;
+  if (pool && below && sizes && sums && lows) {
+    for (; allocated < total; allocated++) {
+      size_t bytes = allocated < level_nodes[0] ? sizeof(struct leaf)
+                                                : sizeof(struct inner);
+      if (!(pool[allocated] = malloc(bytes)))
+        break;
+    }
+  }
+  if (allocated < total) {
+    while (pool && allocated > 0)
+      free(pool[--allocated]);
+    free(pool);
+    free(below);
+    free(sizes);
+    free(sums);
+    free(lows);
+    return -1;
+  }
+
+  void **next = pool;
+  size_t count = level_nodes[0];
+  for (size_t i = 0, start = 0; i < count; i++) {
+    struct leaf *leaf = *next++;
+    size_t end = n * (i + 1) / count;
+    leaf->count = (uint32_t)(end - start);
+    memcpy(leaf->keys, keys + start, leaf->count * sizeof(uint64_t));
+    below[i] = leaf;
+    sizes[i] = leaf->count;
+    sums[i] = node_sum(leaf, 0);
+    lows[i] = leaf->count ? leaf->keys[0] : 0;
+    start = end;
+  }
+
+  // Parent i is written over entry i, which its children have been read
+  // out of by then
+  for (int level = 1; level <= top; level++) {
+    size_t parents = level_nodes[level];
+    for (size_t i = 0, start = 0; i < parents; i++) {
+      struct inner *inner = *next++;
+      size_t end = count * (i + 1) / parents;
+      inner->count = (uint32_t)(end - start);
+      size_t size = 0;
+      uint64_t sum = 0;
+      for (uint32_t j = 0; j < inner->count; j++) {
+        inner->children[j] = below[start + j];
+        inner->counts[j] = sizes[start + j];
+        inner->sums[j] = sums[start + j];
+        if (j > 0)
+          inner->keys[j - 1] = lows[start + j];
+        size += sizes[start + j];
+        sum += sums[start + j];
+      }
+      uint64_t low = lows[start];
+      below[i] = inner;
+      sizes[i] = size;
+      sums[i] = sum;
+      lows[i] = low;
+      start = end;
+    }
+    count = parents;
+  }
+
+  *root = below[0];
+  *height = top;
+  free(pool);
+  free(below);
+  free(sizes);
+  free(sums);
+  free(lows);
+  return 0;
+}
+
+// A sorted copy of keys, or NULL if out of memory
+static uint64_t *sorted_copy(const uint64_t *keys, size_t n) {
+  uint64_t *copy = malloc((n ? n : 1) * sizeof(uint64_t));
+  uint64_t *tmp = malloc((n ? n : 1) * sizeof(uint64_t));
+  if (copy && tmp) {
+    memcpy(copy, keys, n * sizeof(uint64_t));
+    radix_sort(copy, tmp, n);
+  } else {
+    free(copy);
+    copy = NULL;
+  }
+  free(tmp);
+  return copy;
+}
+
+sorted_set_t *sorted_set_from_array(const uint64_t *keys, size_t n) {
+  sorted_set_t *set = malloc(sizeof(sorted_set_t));
+  uint64_t *sorted = sorted_copy(keys, n);
+  if (!set || !sorted || build_tree(sorted, n, &set->root, &set->height)) {
+    free(set);
+    free(sorted);
+    return NULL;
+  }
+  free(sorted);
+  set->size = n;
+  set->sum = 0;
+  for (size_t i = 0; i < n; i++)
+    set->sum += keys[i];
+  init_set(set);
+  return set;
+}
+
+// Copies the keys below node out in order, returning the end of the copy
+static uint64_t *copy_keys(const void *node, int height, uint64_t *out) {
+  if (height == 0) {
+    const struct leaf *leaf = node;
+    memcpy(out, leaf->keys, leaf->count * sizeof(uint64_t));
+    return out + leaf->count;
+  }
+  const struct inner *inner = node;
+  for (uint32_t i = 0; i < inner->count; i++)
+    out = copy_keys(inner->children[i], height - 1, out);
+  return out;
+}
+
+int sorted_set_insert_batch(sorted_set_t *set, const uint64_t *keys,
+                            size_t n) {
+  if (set->shared && reserve_nodes(set) != 0)
+    return -1;
+  uint64_t *batch = sorted_copy(keys, n);
+  if (!batch)
+    return -1;
+  if (n < set->size / MERGE_FRACTION) {
+    // In order, successive keys mostly land in leaves still in cache
+    for (size_t i = 0; i < n; i++) {
+      if (sorted_set_insert(set, batch[i]) != 0) {
+        free(batch);
+        return -1;
+      }
+    }
+    free(batch);
+    return 0;
+  }
+
+  size_t total = set->size + n;
+  uint64_t *old = malloc((set->size ? set->size : 1) * sizeof(uint64_t));
+  uint64_t *merged = malloc((total ? total : 1) * sizeof(uint64_t));
+  void *root;
+  int height;
+  int status = -1;
+  if (old && merged) {
+    copy_keys(set->root, set->height, old);
+    size_t i = 0, j = 0, k = 0;
+    while (i < set->size && j < n)
+      merged[k++] = old[i] <= batch[j] ? old[i++] : batch[j++];
+    while (i < set->size)
+      merged[k++] = old[i++];
+    while (j < n)
+      merged[k++] = batch[j++];
+    status = build_tree(merged, total, &root, &height);
+  }
+  if (status == 0) {
+    release_tree(set, set->root, set->height);
+    set->root = root;
+    set->height = height;
+    set->size = total;
+    for (size_t i = 0; i < n; i++)
+      set->sum += batch[i];
+  }
+  free(old);
+  free(merged);
+  free(batch);
+  return status;
+}
+
+size_t sorted_set_size(const sorted_set_t *set) { return set->size; }
+
+// Finds the smallest key not less than key, if there is one, and the
+// number of keys less than key
+static bool seek(const sorted_set_t *set, uint64_t key, size_t *rank,
+                 uint64_t *found) {
+  const void *node = set->root;
+  // The subtree just right of the path, whose first key follows the
+  // path's last if the leaf runs out
+  const void *after = NULL;
+  int after_height = 0;
+  *rank = 0;
+  for (int height = set->height; height > 0; height--) {
+    const struct inner *inner = node;
+    uint32_t i = lower_bound(inner->keys, inner->count - 1, key);
+    for (uint32_t j = 0; j < i; j++)
+      *rank += inner->counts[j];
+    if (i + 1 < inner->count) {
+      after = inner->children[i + 1];
+      after_height = height - 1;
+    }
+    node = inner->children[i];
+  }
+
+  const struct leaf *leaf = node;
+  uint32_t pos = lower_bound(leaf->keys, leaf->count, key);
+  *rank += pos;
+  if (pos < leaf->count) {
+    *found = leaf->keys[pos];
+    return true;
+  }
+  if (!after)
+    return false;
+  for (; after_height > 0; after_height--)
+    after = ((const struct inner *)after)->children[0];
+  *found = ((const struct leaf *)after)->keys[0];
+  return true;
+}
+
+bool sorted_set_contains(const sorted_set_t *set, uint64_t key) {
+  size_t rank;
+  uint64_t found;
+  return seek(set, key, &rank, &found) && found == key;
+}
+
+size_t sorted_set_rank(const sorted_set_t *set, uint64_t key) {
+  size_t rank;
+  uint64_t found;
+  seek(set, key, &rank, &found);
+  return rank;
+}
+
+int64_t sorted_set_index_of(const sorted_set_t *set, uint64_t key) {
+  size_t rank;
+  uint64_t found;
+  if (seek(set, key, &rank, &found) && found == key)
+    return (int64_t)rank;
+  return -1;
+}
+
+uint64_t sorted_set_select(const sorted_set_t *set, size_t index) {
+  const void *node = set->root;
+  for (int height = set->height; height > 0; height--) {
+    const struct inner *inner = node;
+    uint32_t i = 0;
+    while (index >= inner->counts[i]) {
+      index -= inner->counts[i];
+      i++;
+    }
+    node = inner->children[i];
+  }
+  return ((const struct leaf *)node)->keys[index];
+}
+
+int sorted_set_remove(sorted_set_t *set, uint64_t key) {
+  size_t rank;
+  uint64_t found;
+  if (!seek(set, key, &rank, &found) || found != key)
+    return 0;
+  return sorted_set_remove_at(set, rank, NULL) == 0 ? 1 : -1;
+}
+
+uint64_t sorted_set_min(const sorted_set_t *set) {
+  return sorted_set_select(set, 0);
+}
+
+uint64_t sorted_set_max(const sorted_set_t *set) {
+  return sorted_set_select(set, set->size - 1);
+}
+
+uint64_t sorted_set_sum(const sorted_set_t *set) { return set->sum; }
+
+uint64_t sorted_set_prefix_sum(const sorted_set_t *set, size_t count) {
+  if (count >= set->size)
+    return set->sum;
+  const void *node = set->root;
+  uint64_t sum = 0;
+  for (int height = set->height; height > 0; height--) {
+    const struct inner *inner = node;
+    uint32_t i = 0;
+    while (count >= inner->counts[i]) {
+      count -= inner->counts[i];
+      sum += inner->sums[i];
+      i++;
+    }
+    node = inner->children[i];
+  }
+  const struct leaf *leaf = node;
+  for (size_t i = 0; i < count; i++)
+    sum += leaf->keys[i];
+  return sum;
+}
+
+// Counts and sums the keys less than key, or not greater than it if
+// inclusive
+static void summarize_below(const sorted_set_t *set, uint64_t key,
+                            bool inclusive, size_t *count, uint64_t *sum) {
+  const void *node = set->root;
+  *count = 0;
+  *sum = 0;
+  for (int height = set->height; height > 0; height--) {
+    const struct inner *inner = node;
+    uint32_t i = inclusive ? upper_bound(inner->keys, inner->count - 1, key)
+                           : lower_bound(inner->keys, inner->count - 1, key);
+    for (uint32_t j = 0; j < i; j++) {
+      *count += inner->counts[j];
+      *sum += inner->sums[j];
+    }
+    node = inner->children[i];
+  }
+  const struct leaf *leaf = node;
+  uint32_t pos = inclusive ? upper_bound(leaf->keys, leaf->count, key)
+                           : lower_bound(leaf->keys, leaf->count, key);
+  *count += pos;
+  for (uint32_t i = 0; i < pos; i++)
+    *sum += leaf->keys[i];
+}
+
+size_t sorted_set_range_count(const sorted_set_t *set, uint64_t lo,
+                              uint64_t hi) {
+  if (lo > hi)
+    return 0;
+  size_t below_lo, to_hi;
+  uint64_t sum;
+  summarize_below(set, lo, false, &below_lo, &sum);
+  summarize_below(set, hi, true, &to_hi, &sum);
+  return to_hi - below_lo;
+}
+
+uint64_t sorted_set_range_sum(const sorted_set_t *set, uint64_t lo,
+                              uint64_t hi) {
+  if (lo > hi)
+    return 0;
+  size_t count;
+  uint64_t below_lo, to_hi;
+  summarize_below(set, lo, false, &count, &below_lo);
+  summarize_below(set, hi, true, &count, &to_hi);
+  return to_hi - below_lo;
+}
+
+// Returns false once visit has asked to stop
+static bool visit_range(const void *node, int height, uint64_t lo,
+                        uint64_t hi, sorted_set_visit_t visit, void *arg) {
+  if (height == 0) {
+    const struct leaf *leaf = node;
+    for (uint32_t i = lower_bound(leaf->keys, leaf->count, lo);
+         i < leaf->count && leaf->keys[i] <= hi; i++) {
+      if (!visit(leaf->keys[i], arg))
+        return false;
+    }
+    return true;
+  }
+
+  const struct inner *inner = node;
+  uint32_t i = lower_bound(inner->keys, inner->count - 1, lo);
+  for (; i < inner->count; i++) {
+    if (i > 0 && inner->keys[i - 1] > hi)
+      break;
+    if (!visit_range(inner->children[i], height - 1, lo, hi, visit, arg))
+      return false;
+  }
+  return true;
+}
+
+void sorted_set_for_range(const sorted_set_t *set, uint64_t lo, uint64_t hi,
+                          sorted_set_visit_t visit, void *arg) {
+  if (lo <= hi)
+    visit_range(set->root, set->height, lo, hi, visit, arg);
+}
+
+void sorted_set_share(sorted_set_t *set) { set->shared = true; }
+
+sorted_set_t *sorted_set_snapshot(sorted_set_t *set) {
+  sorted_set_t *snapshot = set->spare_snapshot;
+  set->spare_snapshot = NULL;
+  if (!snapshot && !(snapshot = malloc(sizeof(sorted_set_t))))
+    return NULL;
+  snapshot->root = set->root;
+  snapshot->height = set->height;
+  snapshot->size = set->size;
+  snapshot->sum = set->sum;
+  init_set(snapshot);
+  snapshot->retired = set->retired;
+  set->retired = NULL;
+  return snapshot;
+}
+
+void sorted_set_release_snapshot(sorted_set_t *snapshot) {
+  free_retired(snapshot->retired);
+  free(snapshot);
+}
@@ -0,0 +1,83 @@
+// Ordered set of uint64_t keys kept in a B+-tree whose inner nodes count
+// and sum the keys below each child, so rank, position and sum queries
+// take O(log n) like lookups, insertions and removals do. Keys may repeat,
+// as they could in the sorted list it replaces; equal keys sit next to
+// each other.
+//
+//   gcc -O2 -o sorted_set_bench sorted_set_bench.c sorted_set.c
+#ifndef SORTED_SET_H
+#define SORTED_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct sorted_set sorted_set_t;
+
+// Return false to stop an iteration early
+typedef bool (*sorted_set_visit_t)(uint64_t key, void *arg);
+
+// Returns NULL if out of memory
+sorted_set_t *sorted_set_create(void);
+void sorted_set_destroy(sorted_set_t *set);
+
+// Builds a set from keys in any order in O(n): the keys are radix sorted
+// and packed into a tree bottom up. Returns NULL if out of memory.
+sorted_set_t *sorted_set_from_array(const uint64_t *keys, size_t n);
+
+// Returns -1 if out of memory, leaving the set as it was
+int sorted_set_insert(sorted_set_t *set, uint64_t key);
+// Inserts n keys in any order. The batch is radix sorted, then merged with
+// the set's keys in one pass into a rebuilt tree, or inserted key by key in
+// order if it is small next to the set. Returns -1 if out of memory, which
+// may leave some of a small batch inserted.
+int sorted_set_insert_batch(sorted_set_t *set, const uint64_t *keys,
+                            size_t n);
+
+// Removes one copy of key. Returns 1 if there was one, 0 if not and -1 if
+// out of memory, which only a shared set can run out of when removing.
+int sorted_set_remove(sorted_set_t *set, uint64_t key);
+// Removes the key at position index, which must be less than the size,
+// and stores it in *key unless key is NULL. Returns -1 if out of memory,
+// as sorted_set_remove does.
+int sorted_set_remove_at(sorted_set_t *set, size_t index, uint64_t *key);
+
+size_t sorted_set_size(const sorted_set_t *set);
+bool sorted_set_contains(const sorted_set_t *set, uint64_t key);
+// Number of keys less than key
+size_t sorted_set_rank(const sorted_set_t *set, uint64_t key);
+// Position of the first copy of key in sorted order, or -1 if absent
+int64_t sorted_set_index_of(const sorted_set_t *set, uint64_t key);
+// The key at position index, which must be less than the size
+uint64_t sorted_set_select(const sorted_set_t *set, size_t index);
+// The set must not be empty
+uint64_t sorted_set_min(const sorted_set_t *set);
+uint64_t sorted_set_max(const sorted_set_t *set);
+
+// Sums wrap modulo 2^64. The sum of every key takes O(1).
+uint64_t sorted_set_sum(const sorted_set_t *set);
+// Sum of the count smallest keys
+uint64_t sorted_set_prefix_sum(const sorted_set_t *set, size_t count);
+// Number and sum of the keys in [lo, hi]
+size_t sorted_set_range_count(const sorted_set_t *set, uint64_t lo,
+                              uint64_t hi);
+uint64_t sorted_set_range_sum(const sorted_set_t *set, uint64_t lo,
+                              uint64_t hi);
+
+// Calls visit on every key in [lo, hi] in ascending order
+void sorted_set_for_range(const sorted_set_t *set, uint64_t lo, uint64_t hi,
+                          sorted_set_visit_t visit, void *arg);
+
+// Makes set copy on write: a change copies the nodes it would touch and
+// leaves the originals for earlier snapshots, which other threads may go
+// on reading without locks while one thread at a time changes the set.
+void sorted_set_share(sorted_set_t *set);
+// A read-only view of a shared set as it is now, for the functions that
+// take a const set. Nodes the set stopped using since the previous
+// snapshot are freed with this one, so release snapshots in the order
+// they were taken, each once no thread reads it or an older one. Returns
+// NULL if out of memory, which it cannot be right after a change.
+sorted_set_t *sorted_set_snapshot(sorted_set_t *set);
+void sorted_set_release_snapshot(sorted_set_t *snapshot);
+
+#endif
@@ -0,0 +1,153 @@
+// Times the sorted set against the sorted linked list it replaced in
+// lab6.c, building each from random keys and then looking every key up,
+// and times building the set in bulk.
+//
+//   gcc -O2 -o sorted_set_bench sorted_set_bench.c sorted_set.c
+//   ./sorted_set_bench [keys]
+//
+// The list takes quadratic time to build, so it only gets LIST_KEYS keys.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sorted_set.h"
+
+#define DEFAULT_KEYS 1000000
+#define LIST_KEYS 20000
+
+typedef struct node {
+  uint64_t data;
+  struct node *next;
+} node_t;
+
+static node_t *list_insert(node_t *head, uint64_t data) {
+  node_t *new_node = malloc(sizeof(node_t));
+  new_node->data = data;
+  if (head == NULL || data < head->data) {
+    new_node->next = head;
+    return new_node;
+  }
+  node_t *curr = head;
+  while (curr->next != NULL && curr->next->data < data)
+    curr = curr->next;
+  new_node->next = curr->next;
+  curr->next = new_node;
+  return head;
+}
+
+static int list_index_of(const node_t *head, uint64_t data) {
+  int index = 0;
+  for (const node_t *curr = head; curr != NULL; curr = curr->next, index++) {
+    if (curr->data == data)
+      return index;
+  }
+  return -1;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t n, double insert, double lookup) {
+  printf("%-8s%-12zu%-16.1f%.1f\n", name, n, insert / n * 1e9,
+         lookup / n * 1e9);
+}
+
+static void bench_list(const uint64_t *keys, size_t n) {
+  node_t *head = NULL;
+  double start = now_seconds();
+  for (size_t i = 0; i < n; i++)
+    head = list_insert(head, keys[i]);
+  double inserted = now_seconds();
+  long found = 0;
+  for (size_t i = 0; i < n; i++)
+    found += list_index_of(head, keys[i]) >= 0;
+  double looked_up = now_seconds();
+  if (found != (long)n)
+    fprintf(stderr, "list lost keys\n");
+  report("list", n, inserted - start, looked_up - inserted);
+
+  while (head) {
+    node_t *next = head->next;
+    free(head);
+    head = next;
+  }
+}
+
+static void bench_set(const uint64_t *keys, size_t n) {
+  sorted_set_t *set = sorted_set_create();
+  double start = now_seconds();
+  for (size_t i = 0; i < n; i++) {
+    if (sorted_set_insert(set, keys[i]) != 0) {
+      perror("sorted_set_insert");
+      exit(1);
+    }
+  }
+  double inserted = now_seconds();
+  size_t found = 0;
+  for (size_t i = 0; i < n; i++)
+    found += sorted_set_index_of(set, keys[i]) >= 0;
+  double looked_up = now_seconds();
+  if (found != n)
+    fprintf(stderr, "set lost keys\n");
+  report("set", n, inserted - start, looked_up - inserted);
+  sorted_set_destroy(set);
+}
+
+// Builds from the whole array at once, and by merging ten batches in turn
+static void bench_bulk(const uint64_t *keys, size_t n) {
+  double start = now_seconds();
+  sorted_set_t *set = sorted_set_from_array(keys, n);
+  double built = now_seconds();
+  if (!set) {
+    perror("sorted_set_from_array");
+    exit(1);
+  }
+  if (sorted_set_size(set) != n)
+    fprintf(stderr, "bulk build lost keys\n");
+  sorted_set_destroy(set);
+
+  set = sorted_set_create();
+  double batch_start = now_seconds();
+  for (size_t done = 0; done < n; done += n / 10 + 1) {
+    size_t batch = n - done < n / 10 + 1 ? n - done : n / 10 + 1;
+    if (sorted_set_insert_batch(set, keys + done, batch) != 0) {
+      perror("sorted_set_insert_batch");
+      exit(1);
+    }
+  }
+  double batched = now_seconds();
+  if (sorted_set_size(set) != n)
+    fprintf(stderr, "batch insert lost keys\n");
+  sorted_set_destroy(set);
+
+  printf("\n%-8s%-12s%s\n", "", "Keys", "Build ms");
+  printf("%-8s%-12zu%.1f\n", "bulk", n, (built - start) * 1e3);
+  printf("%-8s%-12zu%.1f\n", "batches", n, (batched - batch_start) * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_KEYS;
+  uint64_t *keys = malloc((n > LIST_KEYS ? n : LIST_KEYS) * sizeof(uint64_t));
+  uint64_t rng = 88172645463325252ull;
+  for (size_t i = 0; i < n || i < LIST_KEYS; i++)
+    keys[i] = next_random(&rng);
+
+  printf("%-8s%-12s%-16s%s\n", "", "Keys", "Insert ns/key", "index_of ns/key");
+  bench_list(keys, LIST_KEYS);
+  bench_set(keys, LIST_KEYS);
+  bench_set(keys, n);
+  bench_bulk(keys, n);
+  free(keys);
+  return 0;
+}
@@ -1,12 +1,44 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_INPUTS 100
-#define MAX_LINE_NUMS 100
+#define INITIAL_INPUTS 1024
+#define INITIAL_SLOTS 64
+#define INITIAL_LINE_NUMS 4
+#define INITIAL_BUCKET 256
+// Work is split into this many map partitions and reduce buckets per thread
+// so that a slow partition does not leave the other threads idle.
+#define TASKS_PER_THREAD 4
+// Read buffer per run during the reduce-side merge, shrunk towards the
+// minimum when many runs have to share a reducer's part of the budget
+#define RUN_BUFFER 65536
+#define MIN_RUN_BUFFER 64
+#define READ_BLOCK (1 << 20)
+// Records mapped per call of a job's map kernel
+#define MAP_BATCH 1024
 
+#define handle_error(msg)                                                      \
+  do {                                                                         \
+    perror(msg);                                                               \
+    exit(EXIT_FAILURE);                                                        \
+  } while (0)
+
+// Input records by column: record i is values[i], read on line_numbers[i]
 typedef struct {
-  int line_number;
-  int value;
+  int *line_numbers;
+  int *values;
+  size_t count;
 } Input;
 
 typedef struct {
@@ -16,67 +48,438 @@ typedef struct {
 
 typedef struct {
   int doubled_value;
-  int line_numbers[MAX_LINE_NUMS];
+  int *line_numbers; // grows by doubling, so it never overflows
   int line_count;
+  int line_capacity;
 } Output;
 
-void map(Input *input, IntermediateInput *intermediate_input);
-void groupByKey(IntermediateInput *input, Output *output, int *result_count);
+// Values parsed from the input, one per line; value i is on line i + 1
+typedef struct {
+  int *values;
+  size_t count;
+  size_t capacity;
+  int done; // set once the `end` sentinel has been read
+} ValueColumn;
+
+// Outputs in first-seen order, plus an open-addressing index from
+// doubled_value to position in `outputs` (-1 marks an empty slot)
+typedef struct {
+  Output *outputs;
+  int output_count;
+  int output_capacity;
+  int *slots;
+  int slot_count; // power of two
+} GroupTable;
+
+// Maps a batch of input values to their keys; line numbers pass through
+typedef void (*MapFn)(const int *restrict values, int *restrict keys,
+                      size_t count);
+typedef void (*ReduceFn)(Output *output, void *state);
+
+// A MapReduce job. Inputs are cut into `partitions` ranges that are mapped
+// in parallel; every mapped record is routed by key hash to one of
+// `reducers` buckets, and each bucket is grouped and reduced by one thread.
+//
+// With a memory_budget (bytes of bucket memory for mapped records), mappers
+// spill sorted runs to temporary files instead of growing past it, and reducers
+// stream a k-way merge of those runs, handing each group to `reduce` as soon
+// as it is complete instead of keeping it in a GroupTable.
+typedef struct {
+  MapFn map;
+  ReduceFn reduce;      // may be NULL to only group
+  void **reduce_states; // [r] is passed to reduce for bucket r; may be NULL
+  int threads;
+  int partitions;
+  int reducers;
+  size_t memory_budget; // 0 keeps everything in memory
+} Job;
+
+// Mapped records of one partition headed for one reducer
+typedef struct {
+  IntermediateInput *records;
+  size_t count;
+  size_t capacity;
+} Bucket;
+
+// A sorted run of one reducer's records inside a spill file. Records are
+// written as varints: the key as a delta from the previous key, then the
+// line number as a delta from the previous line of the same key (or in full
+// for a new key).
+typedef struct Run {
+  int fd;
+  off_t offset;
+  size_t count;
+  struct Run *next;
+} Run;
+
+typedef struct SpillFile {
+  FILE *file;
+  struct SpillFile *next;
+} SpillFile;
+
+// Streams records back out of a Run
+typedef struct {
+  int fd;
+  off_t offset;
+  size_t remaining;
+  int prev_key;
+  int prev_line;
+  size_t pos;
+  size_t len;
+  size_t buf_size;
+  unsigned char *buf;
+} RunReader;
+
+// One input of the reduce-side merge: a run on disk or a sorted array
+typedef struct {
+  IntermediateInput current;
+  RunReader *reader;
+  IntermediateInput *records;
+  size_t pos;
+  size_t count;
+} MergeSource;
+
+typedef struct {
+  const Job *job;
+  const Input *inputs;
+  Bucket *buckets; // partitions x reducers, row-major
+  GroupTable *groups;
+  atomic_int next_partition;
+  atomic_int next_reducer;
+  atomic_size_t resident_bytes; // bucket memory charged to memory_budget
+  atomic_size_t kept_bytes;     // the part held by finished partitions
+  atomic_int partitions_done;
+  pthread_mutex_t spill_lock; // guards runs and spill_files
+  Run **runs;                   // one list per reducer
+  SpillFile *spill_files;
+  pthread_mutex_t start_lock; // held until the barrier is sized
+  pthread_barrier_t barrier;  // for the workers that were started
+} JobState;
+
+void map(const int *restrict values, int *restrict doubled_values,
+         size_t count);
+void initGroups(GroupTable *groups);
+void groupByKey(IntermediateInput *input, GroupTable *groups);
+void freeGroups(GroupTable *groups);
 void reduce(Output output);
+void runJob(const Job *job, const Input *inputs, GroupTable *groups);
+void runBenchmark(size_t value_count, int max_threads, size_t budget);
+void runMapBenchmark(size_t value_count);
+void readValues(int fd, ValueColumn *column);
+
+static int firstLineCmp(const void *a, const void *b) {
+  const Output *x = *(Output *const *)a;
+  const Output *y = *(Output *const *)b;
+  return (x->line_numbers[0] > y->line_numbers[0]) -
+         (x->line_numbers[0] < y->line_numbers[0]);
+}
 
-int main() {
-  Input inputs[MAX_INPUTS];
-  IntermediateInput intermediate_inputs[MAX_INPUTS];
-  Output outputs[MAX_INPUTS];
-  int input_count = 0;
-  int result_count = 0;
+// Reducers run in parallel, so keep each printed group on one line
+static void printOutput(Output *output, void *state) {
+  (void)state;
+  flockfile(stdout);
+  reduce(*output);
+  funlockfile(stdout);
+}
 
-  char buffer[64];
+int main(int argc, char *argv[]) {
+  int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  size_t budget = 0;
+
+  if (argc >= 3 && strcmp(argv[1], "bench") == 0) {
+    if (argc > 3)
+      threads = atoi(argv[3]);
+    if (argc > 4)
+      budget = strtoull(argv[4], NULL, 10);
+    runBenchmark(strtoull(argv[2], NULL, 10), threads < 1 ? 1 : threads,
+                 budget);
+    return 0;
+  }
+  if (argc >= 3 && strcmp(argv[1], "mapbench") == 0) {
+    runMapBenchmark(strtoull(argv[2], NULL, 10));
+    return 0;
+  }
+  if (argc > 1)
+    threads = atoi(argv[1]);
+  if (argc > 2)
+    budget = strtoull(argv[2], NULL, 10);
+  if (threads < 1) {
+    fprintf(stderr,
+            "Usage: %s [threads [memory_budget]] | "
+            "%s bench <values> [threads [memory_budget]] | "
+            "%s mapbench <values>\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
 
   printf("Enter values (one per line). Type 'end' to finish:\n");
+  fflush(stdout);
+
+  ValueColumn column = {0};
+  readValues(STDIN_FILENO, &column);
+
+  Input inputs = {
+      .line_numbers = malloc((column.count + 1) * sizeof(int)),
+      .values = column.values,
+      .count = column.count,
+  };
+  for (size_t i = 0; i < inputs.count; i++)
+    inputs.line_numbers[i] = (int)i + 1;
+
+  // A spilling job streams its groups out in key order per reducer; an
+  // in-memory one is printed below in the order keys first appeared, as the
+  // sequential version did.
+  Job job = {
+      .map = map,
+      .reduce = budget ? printOutput : NULL,
+      .threads = threads,
+      .partitions = threads * TASKS_PER_THREAD,
+      .reducers = threads * TASKS_PER_THREAD,
+      .memory_budget = budget,
+  };
+  GroupTable *groups = malloc(job.reducers * sizeof(GroupTable));
+  runJob(&job, &inputs, groups);
+
+  size_t output_count = 0;
+  for (int r = 0; r < job.reducers; r++)
+    output_count += groups[r].output_count;
+  Output **outputs = malloc((output_count + 1) * sizeof(Output *));
+  size_t n = 0;
+  for (int r = 0; r < job.reducers; r++) {
+    for (int i = 0; i < groups[r].output_count; i++)
+      outputs[n++] = &groups[r].outputs[i];
+  }
+  qsort(outputs, output_count, sizeof(Output *), firstLineCmp);
+
+  for (size_t i = 0; i < output_count; i++) {
+    reduce(*outputs[i]);
+  }
+
+  for (int r = 0; r < job.reducers; r++)
+    freeGroups(&groups[r]);
+  free(outputs);
+  free(groups);
+  free(inputs.line_numbers);
+  free(inputs.values);
+  return 0;
+}
 
-  while (1) {
-    if (scanf("%s", buffer) != 1)
+static int isBlank(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// SWAR digit handling on eight characters loaded as a little-endian word
+static int allDigits(uint64_t chunk) {
+  // Every byte is 0x30-0x39 iff its high nibble is 3 before and after +6
+  return (chunk & 0xF0F0F0F0F0F0F0F0ull) == 0x3030303030303030ull &&
+         ((chunk + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull) ==
+             0x3030303030303030ull;
+}
+
+static uint32_t eightDigits(uint64_t chunk) {
+  chunk -= 0x3030303030303030ull;
+  // Combine neighbouring digits into 2-digit, then 4-digit, then 8-digit
+  // numbers, each step doing all lanes in one multiply
+  chunk = chunk * 10 + (chunk >> 8);
+  chunk = ((chunk & 0x000000FF000000FFull) * (100 + (1000000ull << 32)) +
+           ((chunk >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32))) >>
+          32;
+  return (uint32_t)chunk;
+}
+#endif
+
+// Reads the integer at the start of a token the way "%d" would: an optional
+// sign and then digits up to the first non-digit (0 if there are none).
+static int parseValue(const char *p, size_t len) {
+  size_t i = 0;
+  int negative = 0;
+  if (len > 0 && (p[0] == '-' || p[0] == '+'))
+    negative = p[i++] == '-';
+
+  uint32_t v = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (len - i >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, p + i, 8);
+    if (!allDigits(chunk))
       break;
-    if (strcmp(buffer, "end") == 0)
+    v = v * 100000000u + eightDigits(chunk);
+    i += 8;
+  }
+#endif
+  for (; i < len && p[i] >= '0' && p[i] <= '9'; i++)
+    v = v * 10 + (uint32_t)(p[i] - '0');
+  return (int)(negative ? 0u - v : v);
+}
+
+// Parses the whitespace-separated tokens in [p, p + len) into column,
+// stopping at `end`. Unless at_eof, a token running up to the end of the
+// buffer may continue in the next block and is left for the caller.
+// Returns how many bytes were consumed.
+static size_t parseTokens(ValueColumn *column, const char *p, size_t len,
+                          int at_eof) {
+  size_t i = 0;
+  while (!column->done) {
+    while (i < len && isBlank(p[i]))
+      i++;
+    size_t start = i;
+    while (i < len && !isBlank(p[i]))
+      i++;
+    if (start == i || (i == len && !at_eof))
+      return start;
+
+    if (i - start == 3 && memcmp(p + start, "end", 3) == 0) {
+      column->done = 1;
       break;
-    inputs[input_count].line_number = input_count + 1;
-    sscanf(buffer, "%d", &inputs[input_count].value);
-    input_count++;
+    }
+    if (column->count == column->capacity) {
+      column->capacity =
+          column->capacity ? column->capacity * 2 : INITIAL_INPUTS;
+      column->values = realloc(column->values, column->capacity * sizeof(int));
+    }
+    column->values[column->count++] = parseValue(p + start, i - start);
   }
+  return i;
+}
 
-  for (int i = 0; i < input_count; i++) {
-    map(&inputs[i], &intermediate_inputs[i]);
+// Appends every value in fd up to `end` or end of file to column. Regular
+// files are mapped and parsed in place; pipes and terminals are read in
+// large blocks, so a terminal still stops right after the line with `end`.
+void readValues(int fd, ValueColumn *column) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+      parseTokens(column, data, st.st_size, 1);
+      munmap(data, st.st_size);
+      return;
+    }
   }
 
-  for (int i = 0; i < input_count; i++) {
-    groupByKey(&intermediate_inputs[i], outputs, &result_count);
+  size_t capacity = READ_BLOCK;
+  char *buffer = malloc(capacity);
+  size_t len = 0;
+  while (!column->done) {
+    if (len == capacity) { // one token fills the whole buffer
+      capacity *= 2;
+      buffer = realloc(buffer, capacity);
+    }
+    ssize_t n = read(fd, buffer + len, capacity - len);
+    if (n < 0)
+      handle_error("read");
+    len += (size_t)n;
+    size_t used = parseTokens(column, buffer, len, n == 0);
+    memmove(buffer, buffer + used, len - used);
+    len -= used;
+    if (n == 0)
+      break;
   }
+  free(buffer);
+}
 
-  for (int i = 0; i < result_count; i++) {
-    reduce(outputs[i]);
+// Four values per SSE2 add; the tail (or everything, without SSE2) is a
+// plain loop over restrict-qualified columns that compilers can vectorise
+void map(const int *restrict values, int *restrict doubled_values,
+         size_t count) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+    _mm_storeu_si128((__m128i *)(doubled_values + i), _mm_add_epi32(v, v));
   }
+#endif
+  for (; i < count; i++)
+    doubled_values[i] = (int)((unsigned)values[i] * 2u);
+}
 
-  return 0;
+static int slotFor(int key, int slot_count) {
+  // Fibonacci hashing: the top bits of the product are well mixed
+  uint32_t h = (uint32_t)key * 2654435769u;
+  return (int)(h >> (32 - __builtin_ctz((unsigned)slot_count)));
+}
+
+// Independent of slotFor, so one reducer's keys still spread over its table
+static int reducerFor(int key, int reducers) {
+  uint32_t h = (uint32_t)key;
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35u;
+  h ^= h >> 16;
+  return (int)(h % (uint32_t)reducers);
+}
+
+static void allocSlots(GroupTable *groups, int slot_count) {
+  groups->slot_count = slot_count;
+  groups->slots = malloc(slot_count * sizeof(int));
+  memset(groups->slots, -1, slot_count * sizeof(int));
 }
 
-void map(Input *input, IntermediateInput *intermediate_input) {
-  intermediate_input->line_number = input->line_number;
-  intermediate_input->doubled_value = input->value * 2;
+void initGroups(GroupTable *groups) {
+  groups->output_count = 0;
+  groups->output_capacity = INITIAL_SLOTS / 2;
+  groups->outputs = malloc(groups->output_capacity * sizeof(Output));
+  allocSlots(groups, INITIAL_SLOTS);
 }
 
-void groupByKey(IntermediateInput *input, Output *output, int *result_count) {
-  for (int i = 0; i < *result_count; i++) {
-    if (output[i].doubled_value == input->doubled_value) {
-      output[i].line_numbers[output[i].line_count++] = input->line_number;
+// Doubles the index once it is half full and re-inserts every key
+static void growSlots(GroupTable *groups) {
+  free(groups->slots);
+  allocSlots(groups, groups->slot_count * 2);
+  for (int i = 0; i < groups->output_count; i++) {
+    int s = slotFor(groups->outputs[i].doubled_value, groups->slot_count);
+    while (groups->slots[s] != -1)
+      s = (s + 1) & (groups->slot_count - 1);
+    groups->slots[s] = i;
+  }
+}
+
+static void appendLine(Output *output, int line_number) {
+  if (output->line_count == output->line_capacity) {
+    output->line_capacity *= 2;
+    output->line_numbers =
+        realloc(output->line_numbers, output->line_capacity * sizeof(int));
+  }
+  output->line_numbers[output->line_count++] = line_number;
+}
+
+void groupByKey(IntermediateInput *input, GroupTable *groups) {
+  int s = slotFor(input->doubled_value, groups->slot_count);
+  while (groups->slots[s] != -1) {
+    Output *output = &groups->outputs[groups->slots[s]];
+    if (output->doubled_value == input->doubled_value) {
+      appendLine(output, input->line_number);
       return;
     }
+    s = (s + 1) & (groups->slot_count - 1);
   }
 
-  output[*result_count].doubled_value = input->doubled_value;
-  output[*result_count].line_numbers[0] = input->line_number;
-  output[*result_count].line_count = 1;
-  (*result_count)++;
+  if (groups->output_count == groups->output_capacity) {
+    groups->output_capacity *= 2;
+    groups->outputs =
+        realloc(groups->outputs, groups->output_capacity * sizeof(Output));
+  }
+
+  Output *output = &groups->outputs[groups->output_count];
+  output->doubled_value = input->doubled_value;
+  output->line_capacity = INITIAL_LINE_NUMS;
+  output->line_numbers = malloc(output->line_capacity * sizeof(int));
+  output->line_numbers[0] = input->line_number;
+  output->line_count = 1;
+  groups->slots[s] = groups->output_count++;
+
+  if (groups->output_count * 2 > groups->slot_count)
+    growSlots(groups);
+}
+
+void freeGroups(GroupTable *groups) {
+  for (int i = 0; i < groups->output_count; i++)
+    free(groups->outputs[i].line_numbers);
+  free(groups->outputs);
+  free(groups->slots);
 }
 
 void reduce(Output output) {
@@ -88,3 +491,594 @@ void reduce(Output output) {
   }
   printf("])\n");
 }
+
+static void bucketPush(Bucket *bucket, IntermediateInput record) {
+  if (bucket->count == bucket->capacity) {
+    bucket->capacity =
+        bucket->capacity ? bucket->capacity * 2 : INITIAL_BUCKET;
+    bucket->records = realloc(bucket->records,
+                              bucket->capacity * sizeof(IntermediateInput));
+  }
+  bucket->records[bucket->count++] = record;
+}
+
+static void *reduceState(const Job *job, int r) {
+  return job->reduce_states ? job->reduce_states[r] : NULL;
+}
+
+static int recordCmp(const void *a, const void *b) {
+  const IntermediateInput *x = a;
+  const IntermediateInput *y = b;
+  if (x->doubled_value != y->doubled_value)
+    return x->doubled_value < y->doubled_value ? -1 : 1;
+  return (x->line_number > y->line_number) - (x->line_number < y->line_number);
+}
+
+static size_t putVarint(unsigned char *out, uint32_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (unsigned char)v;
+  return n;
+}
+
+// Sorts and appends every non-empty bucket of a partition's row to the
+// partition's spill file as one run per reducer, then frees the buckets and
+// returns their memory to the budget.
+// The file is created on the first spill; *offset tracks its end.
+static void spillRow(JobState *state, Bucket *row, FILE **spill,
+                     off_t *offset) {
+  int reducers = state->job->reducers;
+  if (!*spill) {
+    *spill = tmpfile();
+    if (!*spill)
+      handle_error("tmpfile");
+    SpillFile *spill_file = malloc(sizeof(SpillFile));
+    spill_file->file = *spill;
+    pthread_mutex_lock(&state->spill_lock);
+    spill_file->next = state->spill_files;
+    state->spill_files = spill_file;
+    pthread_mutex_unlock(&state->spill_lock);
+  }
+  FILE *file = *spill;
+
+  Run *new_runs = calloc(reducers, sizeof(Run));
+  unsigned char encoded[10];
+  for (int r = 0; r < reducers; r++) {
+    Bucket *bucket = &row[r];
+    if (bucket->count == 0)
+      continue;
+    qsort(bucket->records, bucket->count, sizeof(IntermediateInput),
+          recordCmp);
+
+    new_runs[r].fd = fileno(file);
+    new_runs[r].offset = *offset;
+    new_runs[r].count = bucket->count;
+    int prev_key = 0;
+    int prev_line = 0;
+    for (size_t i = 0; i < bucket->count; i++) {
+      IntermediateInput *rec = &bucket->records[i];
+      size_t n = putVarint(encoded, (uint32_t)rec->doubled_value -
+                                        (uint32_t)prev_key);
+      int same_key = i > 0 && rec->doubled_value == prev_key;
+      n += putVarint(encoded + n, (uint32_t)rec->line_number -
+                                      (uint32_t)(same_key ? prev_line : 0));
+      if (fwrite(encoded, 1, n, file) != n)
+        handle_error("fwrite spill");
+      *offset += (off_t)n;
+      prev_key = rec->doubled_value;
+      prev_line = rec->line_number;
+    }
+    atomic_fetch_sub(&state->resident_bytes,
+                     bucket->capacity * sizeof(IntermediateInput));
+    free(bucket->records);
+    *bucket = (Bucket){0};
+  }
+  if (fflush(file) != 0)
+    handle_error("fflush spill");
+
+  pthread_mutex_lock(&state->spill_lock);
+  for (int r = 0; r < reducers; r++) {
+    if (new_runs[r].count == 0)
+      continue;
+    Run *run = malloc(sizeof(Run));
+    *run = new_runs[r];
+    run->next = state->runs[r];
+    state->runs[r] = run;
+  }
+  pthread_mutex_unlock(&state->spill_lock);
+  free(new_runs);
+}
+
+// Adds bytes to *counter unless that would take it past limit
+static int tryCharge(atomic_size_t *counter, size_t bytes, size_t limit) {
+  if (atomic_fetch_add(counter, bytes) + bytes <= limit)
+    return 1;
+  atomic_fetch_sub(counter, bytes);
+  return 0;
+}
+
+// bucketPush for a spilling job. Bucket memory is charged to the budget
+// before it is allocated, and a row may hold at most `share` bytes. When a
+// bucket cannot grow, the whole row is spilled first; *charged tracks the
+// row's bytes.
+static void bucketPushCharged(JobState *state, Bucket *row, Bucket *bucket,
+                              IntermediateInput record, size_t share,
+                              size_t *charged, FILE **spill,
+                              off_t *spill_end) {
+  const size_t size = sizeof(IntermediateInput);
+  size_t budget = state->job->memory_budget;
+
+  if (bucket->count == bucket->capacity) {
+    // Start small enough that every bucket of the row fits in the share
+    size_t first = share / size / state->job->reducers;
+    first = first < 1 ? 1 : first > INITIAL_BUCKET ? INITIAL_BUCKET : first;
+    size_t grow = bucket->capacity ? bucket->capacity : first;
+    size_t room = *charged < share ? (share - *charged) / size : 0;
+    if (grow > room)
+      grow = room;
+    if (grow == 0 || !tryCharge(&state->resident_bytes, grow * size, budget)) {
+      spillRow(state, row, spill, spill_end);
+      *charged = 0;
+      grow = first;
+      if (!tryCharge(&state->resident_bytes, grow * size, budget)) {
+        // The rest of the budget is taken; go on one record at a time
+        grow = 1;
+        atomic_fetch_add(&state->resident_bytes, size);
+      }
+    }
+    *charged += grow * size;
+    bucket->capacity += grow;
+    bucket->records = realloc(bucket->records, bucket->capacity * size);
+  }
+  bucket->records[bucket->count++] = record;
+}
+
+static void mapPartition(JobState *state, int p) {
+  const Job *job = state->job;
+  size_t start = state->inputs->count * p / job->partitions;
+  size_t end = state->inputs->count * (p + 1) / job->partitions;
+  Bucket *row = &state->buckets[(size_t)p * job->reducers];
+
+  // Each busy thread may buffer its share of the budget before spilling
+  size_t share = job->memory_budget / job->threads;
+  size_t charged = 0;
+
+  FILE *spill = NULL;
+  off_t spill_end = 0;
+  int keys[MAP_BATCH];
+  for (size_t base = start; base < end; base += MAP_BATCH) {
+    size_t n = end - base < MAP_BATCH ? end - base : MAP_BATCH;
+    job->map(state->inputs->values + base, keys, n);
+    const int *lines = state->inputs->line_numbers + base;
+    for (size_t i = 0; i < n; i++) {
+      IntermediateInput record = {lines[i], keys[i]};
+      Bucket *bucket = &row[reducerFor(keys[i], job->reducers)];
+      if (job->memory_budget)
+        bucketPushCharged(state, row, bucket, record, share, &charged, &spill,
+                          &spill_end);
+      else
+        bucketPush(bucket, record);
+    }
+  }
+  if (!job->memory_budget)
+    return;
+
+  // The row may stay in memory only if that still leaves a full share for
+  // every thread that can go on mapping
+  int done = atomic_fetch_add(&state->partitions_done, 1) + 1;
+  int mappers = job->partitions - done;
+  if (mappers > job->threads)
+    mappers = job->threads;
+  size_t reserved = (size_t)mappers * share;
+  size_t limit =
+      job->memory_budget > reserved ? job->memory_budget - reserved : 0;
+  if (charged > 0 && !tryCharge(&state->kept_bytes, charged, limit))
+    spillRow(state, row, &spill, &spill_end);
+}
+
+static int readByte(RunReader *reader, unsigned char *byte) {
+  if (reader->pos == reader->len) {
+    ssize_t n =
+        pread(reader->fd, reader->buf, reader->buf_size, reader->offset);
+    if (n < 0)
+      handle_error("pread spill");
+    if (n == 0)
+      return 0;
+    reader->offset += n;
+    reader->pos = 0;
+    reader->len = (size_t)n;
+  }
+  *byte = reader->buf[reader->pos++];
+  return 1;
+}
+
+static uint32_t readVarint(RunReader *reader) {
+  uint32_t v = 0;
+  unsigned char byte = 0;
+  for (int shift = 0; readByte(reader, &byte); shift += 7) {
+    v |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  return v;
+}
+
+// Advances a merge source; returns 0 once it is exhausted
+static int sourceNext(MergeSource *source) {
+  if (source->records) {
+    if (source->pos == source->count)
+      return 0;
+    source->current = source->records[source->pos++];
+    return 1;
+  }
+
+  RunReader *reader = source->reader;
+  if (reader->remaining == 0)
+    return 0;
+  uint32_t key_delta = readVarint(reader);
+  uint32_t line = readVarint(reader);
+  int key = (int)((uint32_t)reader->prev_key + key_delta);
+  // Line numbers start at 1, so prev_line is 0 only before the first record
+  if (key_delta == 0 && reader->prev_line != 0)
+    line += (uint32_t)reader->prev_line;
+  reader->prev_key = key;
+  reader->prev_line = (int)line;
+  reader->remaining--;
+  source->current.doubled_value = key;
+  source->current.line_number = (int)line;
+  return 1;
+}
+
+static void siftSource(MergeSource **heap, size_t n, size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1;
+    size_t min = i;
+    if (l < n && recordCmp(&heap[l]->current, &heap[min]->current) < 0)
+      min = l;
+    if (l + 1 < n && recordCmp(&heap[l + 1]->current, &heap[min]->current) < 0)
+      min = l + 1;
+    if (min == i)
+      return;
+    MergeSource *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+// Reducer r's side of a spilling job: merge the records still in memory
+// with every run on disk in (key, line) order and reduce one key at a time.
+static void mergeAndReduce(JobState *state, int r) {
+  const Job *job = state->job;
+
+  size_t resident = 0;
+  for (int p = 0; p < job->partitions; p++)
+    resident += state->buckets[(size_t)p * job->reducers + r].count;
+  IntermediateInput *in_memory = malloc((resident + 1) * sizeof(*in_memory));
+  size_t n = 0;
+  for (int p = 0; p < job->partitions; p++) {
+    Bucket *bucket = &state->buckets[(size_t)p * job->reducers + r];
+    if (bucket->count > 0)
+      memcpy(in_memory + n, bucket->records,
+             bucket->count * sizeof(IntermediateInput));
+    n += bucket->count;
+    free(bucket->records);
+    bucket->records = NULL;
+  }
+  qsort(in_memory, n, sizeof(*in_memory), recordCmp);
+
+  size_t run_count = 0;
+  for (Run *run = state->runs[r]; run; run = run->next)
+    run_count++;
+  MergeSource *sources = calloc(run_count + 1, sizeof(MergeSource));
+  MergeSource **heap = malloc((run_count + 1) * sizeof(MergeSource *));
+  RunReader *readers = malloc((run_count + 1) * sizeof(RunReader));
+  size_t heap_size = 0;
+
+  size_t buf_size = RUN_BUFFER;
+  if (run_count > 0) {
+    buf_size = job->memory_budget / job->threads / run_count;
+    buf_size = buf_size < MIN_RUN_BUFFER ? MIN_RUN_BUFFER
+               : buf_size > RUN_BUFFER   ? RUN_BUFFER
+                                         : buf_size;
+  }
+  unsigned char *buffers = malloc(run_count * buf_size + 1);
+
+  sources[0].records = in_memory;
+  sources[0].count = n;
+  size_t i = 1;
+  for (Run *run = state->runs[r]; run; run = run->next, i++) {
+    readers[i] = (RunReader){.fd = run->fd,
+                             .offset = run->offset,
+                             .remaining = run->count,
+                             .buf_size = buf_size,
+                             .buf = buffers + (i - 1) * buf_size};
+    sources[i].reader = &readers[i];
+  }
+  for (i = 0; i <= run_count; i++) {
+    if (sourceNext(&sources[i]))
+      heap[heap_size++] = &sources[i];
+  }
+  for (i = heap_size / 2; i-- > 0;)
+    siftSource(heap, heap_size, i);
+
+  Output output = {.line_capacity = INITIAL_LINE_NUMS};
+  output.line_numbers = malloc(output.line_capacity * sizeof(int));
+  while (heap_size > 0) {
+    IntermediateInput rec = heap[0]->current;
+    if (output.line_count > 0 && rec.doubled_value != output.doubled_value) {
+      if (job->reduce)
+        job->reduce(&output, reduceState(job, r));
+      output.line_count = 0;
+    }
+    output.doubled_value = rec.doubled_value;
+    appendLine(&output, rec.line_number);
+
+    if (!sourceNext(heap[0]))
+      heap[0] = heap[--heap_size];
+    siftSource(heap, heap_size, 0);
+  }
+  if (output.line_count > 0 && job->reduce)
+    job->reduce(&output, reduceState(job, r));
+
+  free(output.line_numbers);
+  free(buffers);
+  free(readers);
+  free(heap);
+  free(sources);
+  free(in_memory);
+}
+
+// Partitions are visited in input order, so line numbers stay sorted
+static void reduceBucket(JobState *state, int r) {
+  const Job *job = state->job;
+  GroupTable *groups = &state->groups[r];
+
+  initGroups(groups);
+  if (job->memory_budget) {
+    mergeAndReduce(state, r);
+    return;
+  }
+
+  for (int p = 0; p < job->partitions; p++) {
+    Bucket *bucket = &state->buckets[(size_t)p * job->reducers + r];
+    for (size_t i = 0; i < bucket->count; i++)
+      groupByKey(&bucket->records[i], groups);
+    free(bucket->records);
+    bucket->records = NULL;
+  }
+
+  if (job->reduce) {
+    for (int i = 0; i < groups->output_count; i++)
+      job->reduce(&groups->outputs[i], reduceState(job, r));
+  }
+}
+
+// Every pool thread pulls map partitions until there are none left, waits
+// for the others, then does the same with reduce buckets.
+static void *jobWorker(void *arg) {
+  JobState *state = (JobState *)arg;
+  int task;
+
+  pthread_mutex_lock(&state->start_lock);
+  pthread_mutex_unlock(&state->start_lock);
+
+  while ((task = atomic_fetch_add(&state->next_partition, 1)) <
+         state->job->partitions)
+    mapPartition(state, task);
+
+  pthread_barrier_wait(&state->barrier);
+
+  while ((task = atomic_fetch_add(&state->next_reducer, 1)) <
+         state->job->reducers)
+    reduceBucket(state, task);
+
+  return NULL;
+}
+
+// Runs job over inputs. groups must have room for job->reducers tables;
+// table r holds the keys routed to reducer r and is freed with freeGroups.
+// If fewer than job->threads workers can be started, the job runs on those
+// that were, or on the calling thread if none were.
+void runJob(const Job *job, const Input *inputs, GroupTable *groups) {
+  JobState state = {
+      .job = job,
+      .inputs = inputs,
+      .buckets = calloc((size_t)job->partitions * job->reducers,
+                        sizeof(Bucket)),
+      .groups = groups,
+      .runs = calloc(job->reducers, sizeof(Run *)),
+  };
+  atomic_init(&state.next_partition, 0);
+  atomic_init(&state.next_reducer, 0);
+  atomic_init(&state.resident_bytes, 0);
+  atomic_init(&state.kept_bytes, 0);
+  atomic_init(&state.partitions_done, 0);
+  pthread_mutex_init(&state.spill_lock, NULL);
+  pthread_mutex_init(&state.start_lock, NULL);
+  pthread_t *threads = malloc(job->threads * sizeof(pthread_t));
+  if (!state.buckets || !state.runs || !threads)
+    handle_error("malloc");
+
+  pthread_mutex_lock(&state.start_lock);
+  int started = 0;
+  for (; started < job->threads; started++) {
+    int err = pthread_create(&threads[started], NULL, jobWorker, &state);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s (running with %d workers)\n",
+              strerror(err), started);
+      break;
+    }
+  }
+  pthread_barrier_init(&state.barrier, NULL, started > 0 ? started : 1);
+  pthread_mutex_unlock(&state.start_lock);
+  if (started == 0)
+    jobWorker(&state);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  for (int r = 0; r < job->reducers; r++) {
+    while (state.runs[r]) {
+      Run *next = state.runs[r]->next;
+      free(state.runs[r]);
+      state.runs[r] = next;
+    }
+  }
+  while (state.spill_files) {
+    SpillFile *next = state.spill_files->next;
+    fclose(state.spill_files->file);
+    free(state.spill_files);
+    state.spill_files = next;
+  }
+
+  pthread_mutex_destroy(&state.spill_lock);
+  pthread_mutex_destroy(&state.start_lock);
+  pthread_barrier_destroy(&state.barrier);
+  free(state.runs);
+  free(threads);
+  free(state.buckets);
+}
+
+static double nowSeconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Benchmark reducer: tallies how many records it saw
+static void countLines(Output *output, void *state) {
+  *(size_t *)state += (size_t)output->line_count;
+}
+
+void runBenchmark(size_t value_count, int max_threads, size_t budget) {
+  Input inputs = {
+      .line_numbers = malloc(value_count * sizeof(int)),
+      .values = malloc(value_count * sizeof(int)),
+      .count = value_count,
+  };
+  uint32_t rng = 2463534242u;
+  // About eight values per distinct key
+  uint32_t key_range = value_count / 8 > 0 ? (uint32_t)(value_count / 8) : 1;
+  for (size_t i = 0; i < value_count; i++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    inputs.line_numbers[i] = (int)i + 1;
+    inputs.values[i] = (int)(rng % key_range);
+  }
+
+  printf("%zu values, about %u keys", value_count, key_range);
+  if (budget)
+    printf(", %zu byte shuffle budget", budget);
+  printf("\n");
+  printf("%-9s%-12s%-14s%s\n", "Threads", "Seconds", "Mvalues/s", "Speedup");
+
+  double base = 0;
+  for (int t = 1;; t = t * 2 > max_threads ? max_threads : t * 2) {
+    Job job = {
+        .map = map,
+        .reduce = countLines,
+        .threads = t,
+        .partitions = t * TASKS_PER_THREAD,
+        .reducers = t * TASKS_PER_THREAD,
+        .memory_budget = budget,
+    };
+    size_t *tallies = calloc(job.reducers, sizeof(size_t));
+    job.reduce_states = malloc(job.reducers * sizeof(void *));
+    for (int r = 0; r < job.reducers; r++)
+      job.reduce_states[r] = &tallies[r];
+    GroupTable *groups = malloc(job.reducers * sizeof(GroupTable));
+
+    double t0 = nowSeconds();
+    runJob(&job, &inputs, groups);
+    double secs = nowSeconds() - t0;
+
+    size_t total = 0;
+    for (int r = 0; r < job.reducers; r++) {
+      total += tallies[r];
+      freeGroups(&groups[r]);
+    }
+    if (t == 1)
+      base = secs;
+    printf("%-9d%-12.4f%-14.1f%.2fx%s\n", t, secs, value_count / secs / 1e6,
+           base / secs, total == value_count ? "" : "  (lost records!)");
+
+    free(groups);
+    free(job.reduce_states);
+    free(tallies);
+    if (t == max_threads)
+      break;
+  }
+
+  free(inputs.line_numbers);
+  free(inputs.values);
+}
+
+// The record-at-a-time layout and map this program used to have, kept as
+// the baseline for runMapBenchmark
+typedef struct {
+  int line_number;
+  int value;
+} InputRecord;
+
+static void mapRecord(const InputRecord *input, IntermediateInput *output) {
+  output->line_number = input->line_number;
+  output->doubled_value = (int)((unsigned)input->value * 2u);
+}
+
+// Times the map stage alone over value_count records: one indirect call
+// per interleaved record against the batched kernel over columns
+void runMapBenchmark(size_t value_count) {
+  InputRecord *records = malloc(value_count * sizeof(InputRecord));
+  IntermediateInput *mapped = malloc(value_count * sizeof(IntermediateInput));
+  int *values = malloc(value_count * sizeof(int));
+  int *keys = malloc(value_count * sizeof(int));
+  for (size_t i = 0; i < value_count; i++) {
+    records[i] = (InputRecord){(int)i + 1, (int)(i * 2654435761u)};
+    values[i] = records[i].value;
+  }
+
+  // Called through volatile pointers so neither loop is inlined away
+  void (*volatile map_record)(const InputRecord *, IntermediateInput *) =
+      mapRecord;
+  volatile MapFn map_batch = map;
+  const int rounds = 5;
+  double per_record = 1e30;
+  double batched = 1e30;
+  for (int round = 0; round < rounds; round++) {
+    double t0 = nowSeconds();
+    for (size_t i = 0; i < value_count; i++)
+      map_record(&records[i], &mapped[i]);
+    double t1 = nowSeconds();
+    for (size_t i = 0; i < value_count; i += MAP_BATCH)
+      map_batch(values + i, keys + i,
+                value_count - i < MAP_BATCH ? value_count - i : MAP_BATCH);
+    double t2 = nowSeconds();
+    if (t1 - t0 < per_record)
+      per_record = t1 - t0;
+    if (t2 - t1 < batched)
+      batched = t2 - t1;
+  }
+
+  for (size_t i = 0; i < value_count; i++) {
+    if (keys[i] != mapped[i].doubled_value) {
+      fprintf(stderr, "map kernels disagree at record %zu\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  printf("%zu values, best of %d rounds\n", value_count, rounds);
+  printf("%-22s%-12s%-14s%s\n", "Map", "Seconds", "Mvalues/s", "Speedup");
+  printf("%-22s%-12.4f%-14.1f%.2fx\n", "per record, AoS", per_record,
+         value_count / per_record / 1e6, 1.0);
+  printf("%-22s%-12.4f%-14.1f%.2fx\n", "batched, columns", batched,
+         value_count / batched / 1e6, per_record / batched);
+
+  free(keys);
+  free(values);
+  free(mapped);
+  free(records);
+}
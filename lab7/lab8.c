@@ -1,185 +1,1142 @@
-// Lab 8 - Starting Code for sorting data in threads using uthash
+// Lab 8 - Starting Code for sorting data in threads
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <uthash.h>
-#define THREAD_COUNT 3
-typedef const char *word_t;
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#define BENCH_VOCAB 100000
+#define LOCK_STRIPES 64
+#define MIN_BUCKETS 1024
+#define MAX_BUCKETS (1 << 24)
+#define GROUP_SIZE 16
+#define MIN_SLOTS 1024
+#define CTRL_EMPTY 0x80
+#define INLINE_WORD_MAX 24
+#define SKETCH_EMPTY UINT32_MAX
+#define SKETCH_COUNTERS_PER_K 10
+// Heap positions and index slots are stored as uint32_t, and the index has
+// at least twice as many slots as there are counters.
+#define SKETCH_MAX_CAPACITY ((size_t)1 << 31)
 
+// A word is a view into the input text; nothing is copied or NUL-terminated
 typedef struct {
-  word_t word;
+  const char *ptr;
+  size_t len;
+} word_t;
+
+// Words of up to INLINE_WORD_MAX bytes are copied into the entry so that
+// comparing them never touches the input text.
+typedef struct {
+  uint64_t hash;
   size_t count;
-  UT_hash_handle hh;
+  uint32_t len;
+  union {
+    char bytes[INLINE_WORD_MAX];
+    const char *ptr;
+  } key;
 } word_count_entry_t;
 
-word_count_entry_t *create_entry(word_t, size_t);
+// Open-addressing table in the style of a Swiss table. Slots are grouped in
+// runs of GROUP_SIZE; each slot has a control byte holding CTRL_EMPTY or the
+// low 7 bits of its word's hash, so one SIMD compare filters a whole group.
+// Full slots index into `entries`, a dense array that doubles as the entry
+// arena and is what gets sorted for output.
+typedef struct {
+  uint8_t *ctrl;
+  uint32_t *slots;
+  size_t num_slots; // power of two, multiple of GROUP_SIZE
+  word_count_entry_t *entries;
+  size_t num_entries;
+  size_t entries_cap;
+} count_map_t;
+
+typedef struct striped_entry {
+  word_t word;
+  uint64_t hash;
+  size_t count;
+  struct striped_entry *chain;
+} striped_entry_t;
 
-typedef word_count_entry_t *count_map_t;
+// Shared table for the parallel counter. Buckets only ever grow at the head,
+// so readers walk chains without locking and bump counts atomically; a stripe
+// lock is only taken to insert a word that has not been seen yet.
+typedef struct {
+  striped_entry_t **buckets;
+  size_t num_buckets; // power of two
+  pthread_mutex_t stripes[LOCK_STRIPES];
+} striped_map_t;
 
 typedef struct {
-  count_map_t *map;
-  word_t *words;
-  size_t num_words;
-  pthread_mutex_t *lock;
+  striped_map_t *map;
+  const char *text;
+  size_t len;
 } count_thread_args_t;
 
-count_thread_args_t *pack_args(count_map_t *map, word_t *words,
-                               size_t num_words, pthread_mutex_t *lock);
+// One Space-Saving counter. The word's true count lies in
+// [count - error, count].
+typedef struct {
+  word_t word;
+  uint64_t hash;
+  size_t count;
+  size_t error;
+  uint32_t slot; // where this counter sits in the sketch index
+} sketch_counter_t;
+
+// Space-Saving sketch for approximate top-K: at most `capacity` counters
+// kept in a min-heap by count, plus a linear-probing index from word to heap
+// position. Memory stays fixed no matter how many distinct words go by.
+typedef struct {
+  sketch_counter_t *heap;
+  size_t size;
+  size_t capacity;
+  uint32_t *index;
+  size_t index_mask;
+} space_saving_t;
+
+// Per-thread state for count_words_parallel and count_top_k_approx. Every
+// worker owns maps[index] (or sketches[index]) and later takes part in
+// merging them pairwise.
+typedef struct {
+  count_map_t *maps;
+  space_saving_t *sketches;
+  size_t sketch_capacity;
+  size_t index;
+  size_t thread_count;
+  const char *text;
+  size_t len;
+  pthread_barrier_t *barrier;
+} merge_thread_args_t;
+
+count_thread_args_t *pack_args(striped_map_t *map, const char *text,
+                               size_t len);
+
+// Letters, digits, apostrophes, underscores and any non-ASCII byte
+// (so UTF-8 sequences stay whole) make up words; everything else splits them.
+static unsigned char word_chars[256];
+
+static void init_word_chars(void) {
+  for (int c = 0; c < 256; c++) {
+    word_chars[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                    (c >= '0' && c <= '9') || c == '\'' || c == '_' ||
+                    c >= 0x80;
+  }
+}
+
+static inline int is_word_char(char c) {
+  return word_chars[(unsigned char)c];
+}
+
+// Finds the first word in [*pos, end) and advances *pos past it.
+// Returns 0 once there are no words left.
+static inline int next_word(const char **pos, const char *end, word_t *word) {
+  const char *p = *pos;
+  while (p < end && !is_word_char(*p))
+    p++;
+  if (p == end)
+    return 0;
+  const char *start = p;
+  while (p < end && is_word_char(*p))
+    p++;
+  word->ptr = start;
+  word->len = (size_t)(p - start);
+  *pos = p;
+  return 1;
+}
+
+// Mixes eight bytes at a time; good enough to spread words over the table
+static uint64_t hash_word(word_t word) {
+  const char *p = word.ptr;
+  size_t n = word.len;
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ n;
+  while (n >= 8) {
+    uint64_t k;
+    memcpy(&k, p, 8);
+    h = (h ^ k) * 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 32;
+    p += 8;
+    n -= 8;
+  }
+  uint64_t k = 0;
+  memcpy(&k, p, n);
+  h = (h ^ k) * 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+static inline int word_eq(word_t a, word_t b) {
+  return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+static inline const char *entry_key(const word_count_entry_t *e) {
+  return e->len <= INLINE_WORD_MAX ? e->key.bytes : e->key.ptr;
+}
+
+// Bit i of the result is set when group[i] == b
+static inline uint32_t match_byte(const uint8_t *group, uint8_t b) {
+#ifdef __SSE2__
+  __m128i g = _mm_load_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)b)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++)
+    mask |= (uint32_t)(group[i] == b) << i;
+  return mask;
+#endif
+}
+
+static void alloc_slots(count_map_t *m, size_t num_slots) {
+  m->num_slots = num_slots;
+  m->ctrl = aligned_alloc(GROUP_SIZE, num_slots);
+  memset(m->ctrl, CTRL_EMPTY, num_slots);
+  m->slots = malloc(num_slots * sizeof(uint32_t));
+}
+
+static void count_map_init(count_map_t *m, size_t expected_words) {
+  size_t n = MIN_SLOTS;
+  while (n / 8 * 7 < expected_words)
+    n <<= 1;
+  alloc_slots(m, n);
+  m->entries_cap = n / 8 * 7;
+  m->entries = malloc(m->entries_cap * sizeof(word_count_entry_t));
+  m->num_entries = 0;
+}
+
+// Puts entry index `idx` into the first empty slot of its probe sequence
+static void place_entry(count_map_t *m, uint64_t hash, uint32_t idx) {
+  size_t group_mask = m->num_slots / GROUP_SIZE - 1;
+  size_t g = (hash >> 7) & group_mask;
+  for (size_t step = 1;; step++) {
+    uint8_t *group = m->ctrl + g * GROUP_SIZE;
+    uint32_t empties = match_byte(group, CTRL_EMPTY);
+    if (empties) {
+      size_t slot = g * GROUP_SIZE + (size_t)__builtin_ctz(empties);
+      m->ctrl[slot] = hash & 0x7F;
+      m->slots[slot] = idx;
+      return;
+    }
+    // Triangular probing visits every group of a power-of-two table
+    g = (g + step) & group_mask;
+  }
+}
+
+// Re-indexes every entry from its stored hash
+static void rebuild_slots(count_map_t *m, size_t num_slots) {
+  free(m->ctrl);
+  free(m->slots);
+  alloc_slots(m, num_slots);
+  for (size_t i = 0; i < m->num_entries; i++)
+    place_entry(m, m->entries[i].hash, (uint32_t)i);
+}
+
+// Adds n to the count for word, whose hash has already been computed
+static void count_map_add(count_map_t *m, word_t word, uint64_t hash,
+                          size_t n) {
+  uint8_t h2 = hash & 0x7F;
+  size_t group_mask = m->num_slots / GROUP_SIZE - 1;
+  size_t g = (hash >> 7) & group_mask;
+  for (size_t step = 1;; step++) {
+    const uint8_t *group = m->ctrl + g * GROUP_SIZE;
+    for (uint32_t hits = match_byte(group, h2); hits; hits &= hits - 1) {
+      word_count_entry_t *e =
+          &m->entries[m->slots[g * GROUP_SIZE + __builtin_ctz(hits)]];
+      if (e->hash == hash && e->len == word.len &&
+          memcmp(entry_key(e), word.ptr, word.len) == 0) {
+        e->count += n;
+        return;
+      }
+    }
+    if (match_byte(group, CTRL_EMPTY))
+      break;
+    g = (g + step) & group_mask;
+  }
+
+  // Not found. Keep the load factor at or below 7/8.
+  if (m->num_entries == m->entries_cap) {
+    m->entries_cap *= 2;
+    m->entries =
+        realloc(m->entries, m->entries_cap * sizeof(word_count_entry_t));
+    rebuild_slots(m, m->num_slots * 2);
+  }
+
+  word_count_entry_t *e = &m->entries[m->num_entries];
+  e->hash = hash;
+  e->count = n;
+  e->len = (uint32_t)word.len;
+  if (word.len <= INLINE_WORD_MAX)
+    memcpy(e->key.bytes, word.ptr, word.len);
+  else
+    e->key.ptr = word.ptr;
+  place_entry(m, hash, (uint32_t)m->num_entries);
+  m->num_entries++;
+}
+
+static void striped_map_init(striped_map_t *m, size_t expected_words) {
+  size_t n = MIN_BUCKETS;
+  while (n < expected_words && n < MAX_BUCKETS)
+    n <<= 1;
+  m->buckets = calloc(n, sizeof(striped_entry_t *));
+  m->num_buckets = n;
+  for (size_t i = 0; i < LOCK_STRIPES; i++)
+    pthread_mutex_init(&m->stripes[i], NULL);
+}
+
+static striped_entry_t *find_in_chain(striped_entry_t *e, word_t word,
+                                      striped_entry_t *stop) {
+  for (; e != stop; e = e->chain) {
+    if (word_eq(e->word, word))
+      return e;
+  }
+  return NULL;
+}
+
+static void striped_map_add(striped_map_t *m, word_t word) {
+  uint64_t hash = hash_word(word);
+  size_t b = hash & (m->num_buckets - 1);
+  striped_entry_t *head = __atomic_load_n(&m->buckets[b], __ATOMIC_ACQUIRE);
+
+  striped_entry_t *w = find_in_chain(head, word, NULL);
+  if (w) {
+    __atomic_fetch_add(&w->count, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  pthread_mutex_t *lock = &m->stripes[b % LOCK_STRIPES];
+  pthread_mutex_lock(lock);
+  // Only entries pushed since we loaded `head` need checking again
+  striped_entry_t *new_head = __atomic_load_n(&m->buckets[b], __ATOMIC_ACQUIRE);
+  w = find_in_chain(new_head, word, head);
+  if (w) {
+    __atomic_fetch_add(&w->count, 1, __ATOMIC_RELAXED);
+  } else {
+    w = malloc(sizeof(striped_entry_t));
+    w->word = word;
+    w->hash = hash;
+    w->count = 1;
+    w->chain = new_head;
+    __atomic_store_n(&m->buckets[b], w, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(lock);
+}
+
+// Copies every count into a count_map_t and releases the striped map
+static count_map_t striped_map_to_count_map(striped_map_t *m) {
+  count_map_t map;
+  count_map_init(&map, 0);
+  for (size_t b = 0; b < m->num_buckets; b++) {
+    striped_entry_t *e = m->buckets[b];
+    while (e) {
+      striped_entry_t *next = e->chain;
+      count_map_add(&map, e->word, e->hash, e->count);
+      free(e);
+      e = next;
+    }
+  }
+  for (size_t i = 0; i < LOCK_STRIPES; i++)
+    pthread_mutex_destroy(&m->stripes[i]);
+  free(m->buckets);
+  return map;
+}
 
-static void add_word_counts_in_chunk(count_map_t *map, word_t *words,
-                                     size_t num_words, pthread_mutex_t *lock) {
+static void add_word_counts_in_chunk(count_map_t *map, const char *text,
+                                     size_t len, pthread_mutex_t *lock) {
   // --------- Task 4 --------- \\
   // Make this function thread-safe by using the lock
 
-  for (size_t i = 0; i < num_words; i++) {
+  const char *pos = text;
+  const char *end = text + len;
+  word_t word;
+  while (next_word(&pos, end, &word)) {
+    uint64_t hash = hash_word(word);
+
     if (lock)
       pthread_mutex_lock(lock);
 
-    word_count_entry_t *w = NULL;
-    HASH_FIND_STR(*map, words[i], w);
+    count_map_add(map, word, hash, 1);
 
-    if (w) {
-      w->count++;
-    } else {
-      w = create_entry(words[i], 1);
-      HASH_ADD_STR(*map, word, w);
+    if (lock)
+      pthread_mutex_unlock(lock);
+  }
+}
+
+// Splits text into `parts` byte ranges of about the same size, pushing each
+// cut forward to the end of the word it lands in. Range p is
+// text[bounds[p]] .. text[bounds[p + 1] - 1].
+static void split_text(const char *text, size_t len, size_t parts,
+                       size_t *bounds) {
+  bounds[0] = 0;
+  for (size_t p = 1; p < parts; p++) {
+    size_t b = (size_t)((unsigned __int128)len * p / parts);
+    if (b < bounds[p - 1])
+      b = bounds[p - 1];
+    while (b > 0 && b < len && is_word_char(text[b - 1]))
+      b++;
+    bounds[p] = b;
+  }
+  bounds[parts] = len;
+}
+
+void delete_table(count_map_t *);
+
+// Adds every count in src to *dst and frees src. The smaller of the two maps
+// is the one that gets walked.
+static void merge_maps(count_map_t *dst, count_map_t src) {
+  if (src.num_entries > dst->num_entries) {
+    count_map_t tmp = *dst;
+    *dst = src;
+    src = tmp;
+  }
+
+  for (size_t i = 0; i < src.num_entries; i++) {
+    word_count_entry_t *e = &src.entries[i];
+    word_t word = {entry_key(e), e->len};
+    count_map_add(dst, word, e->hash, e->count);
+  }
+  delete_table(&src);
+}
+
+// Returns -1 if the counters cannot be allocated
+static int sketch_init(space_saving_t *s, size_t capacity) {
+  size_t n = 16;
+  while (n < capacity * 2)
+    n <<= 1;
+  s->heap = malloc(capacity * sizeof(sketch_counter_t));
+  s->size = 0;
+  s->capacity = capacity;
+  s->index = malloc(n * sizeof(uint32_t));
+  if (!s->heap || !s->index) {
+    free(s->heap);
+    free(s->index);
+    return -1;
+  }
+  memset(s->index, 0xFF, n * sizeof(uint32_t));
+  s->index_mask = n - 1;
+  return 0;
+}
+
+static void sketch_free(space_saving_t *s) {
+  free(s->heap);
+  free(s->index);
+}
+
+// Returns the index slot holding word, or the empty slot where it would go
+static size_t sketch_find_slot(const space_saving_t *s, word_t word,
+                               uint64_t hash) {
+  size_t i = hash & s->index_mask;
+  while (s->index[i] != SKETCH_EMPTY) {
+    const sketch_counter_t *c = &s->heap[s->index[i]];
+    if (c->hash == hash && word_eq(c->word, word))
+      return i;
+    i = (i + 1) & s->index_mask;
+  }
+  return i;
+}
+
+// Backward-shift deletion, so lookups never need tombstones
+static void sketch_remove_slot(space_saving_t *s, size_t i) {
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & s->index_mask;
+    if (s->index[j] == SKETCH_EMPTY)
+      break;
+    size_t home = s->heap[s->index[j]].hash & s->index_mask;
+    // Move j into the hole unless its home lies cyclically in (i, j]
+    int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+    if (!stays) {
+      s->index[i] = s->index[j];
+      s->heap[s->index[i]].slot = (uint32_t)i;
+      i = j;
     }
   }
+  s->index[i] = SKETCH_EMPTY;
 }
 
-static void *counter_thread_func(void *param);
+static void sketch_swap(space_saving_t *s, size_t a, size_t b) {
+  sketch_counter_t tmp = s->heap[a];
+  s->heap[a] = s->heap[b];
+  s->heap[b] = tmp;
+  s->index[s->heap[a].slot] = (uint32_t)a;
+  s->index[s->heap[b].slot] = (uint32_t)b;
+}
 
-static count_map_t count_words_parallel(word_t *words, size_t num_words) {
-  // --------- Task 2 --------- \\
-  // Implement this function
-  // Hints:
-  // - Use counter_thread_func for pthread_create(..) and modify as needed.
-  // - Store the threads and their arguments so you can manage them later
-  // - Initialize and pass the mutex to protect the critical sections (Task 4)
+static void sketch_sift_down(space_saving_t *s, size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1;
+    size_t r = l + 1;
+    size_t min = i;
+    if (l < s->size && s->heap[l].count < s->heap[min].count)
+      min = l;
+    if (r < s->size && s->heap[r].count < s->heap[min].count)
+      min = r;
+    if (min == i)
+      return;
+    sketch_swap(s, i, min);
+    i = min;
+  }
+}
 
-  count_map_t map = NULL;
-  pthread_mutex_t count_mutex;
+static void sketch_sift_up(space_saving_t *s, size_t i) {
+  while (i > 0 && s->heap[(i - 1) / 2].count > s->heap[i].count) {
+    sketch_swap(s, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
 
-  pthread_t threads[THREAD_COUNT];
-  count_thread_args_t *threads_args[THREAD_COUNT];
+static void sketch_add(space_saving_t *s, word_t word, uint64_t hash) {
+  size_t slot = sketch_find_slot(s, word, hash);
+  if (s->index[slot] != SKETCH_EMPTY) {
+    size_t pos = s->index[slot];
+    s->heap[pos].count++;
+    sketch_sift_down(s, pos);
+    return;
+  }
 
-  size_t chunk_size = num_words / THREAD_COUNT;
+  if (s->size < s->capacity) {
+    size_t pos = s->size++;
+    s->heap[pos] = (sketch_counter_t){word, hash, 1, 0, (uint32_t)slot};
+    s->index[slot] = (uint32_t)pos;
+    sketch_sift_up(s, pos);
+    return;
+  }
 
-  // TODO: Perform initialization
-  pthread_mutex_init(&count_mutex, NULL);
+  // Full: the new word takes over the smallest counter
+  sketch_counter_t *min = &s->heap[0];
+  sketch_remove_slot(s, min->slot);
+  slot = sketch_find_slot(s, word, hash);
+  min->word = word;
+  min->hash = hash;
+  min->error = min->count;
+  min->count++;
+  min->slot = (uint32_t)slot;
+  s->index[slot] = 0;
+  sketch_sift_down(s, 0);
+}
 
-  // Launch threads
-  for (size_t i = 0; i < THREAD_COUNT; i++) {
-    word_t *thread_arg_words = words + i * chunk_size;
-    size_t thread_arg_num_words =
-        chunk_size + (i == THREAD_COUNT - 1 ? num_words % THREAD_COUNT : 0);
+static int counter_count_cmp(const void *a, const void *b) {
+  const sketch_counter_t *x = a;
+  const sketch_counter_t *y = b;
+  return (x->count > y->count) - (x->count < y->count);
+}
+
+// Folds src into *dst and frees src. A word missing from a full sketch may
+// still have up to that sketch's minimum count, so it is credited with that
+// minimum (and the same amount of error) before the largest counters are
+// kept.
+static void sketch_merge(space_saving_t *dst, space_saving_t *src) {
+  size_t dmin = dst->size == dst->capacity ? dst->heap[0].count : 0;
+  size_t smin = src->size == src->capacity ? src->heap[0].count : 0;
+
+  size_t n = dst->size;
+  sketch_counter_t *all = malloc((dst->size + src->size) * sizeof(*all));
+  if (!all) {
+    perror("sketch_merge");
+    exit(1);
+  }
+  memcpy(all, dst->heap, n * sizeof(*all));
+  for (size_t i = 0; i < n; i++) {
+    all[i].count += smin;
+    all[i].error += smin;
+  }
+  for (size_t i = 0; i < src->size; i++) {
+    sketch_counter_t c = src->heap[i];
+    size_t slot = sketch_find_slot(dst, c.word, c.hash);
+    if (dst->index[slot] != SKETCH_EMPTY) {
+      all[dst->index[slot]].count += c.count - smin;
+      all[dst->index[slot]].error += c.error - smin;
+    } else {
+      c.count += dmin;
+      c.error += dmin;
+      all[n++] = c;
+    }
+  }
+
+  // An ascending array is already a valid min-heap
+  qsort(all, n, sizeof(*all), counter_count_cmp);
+  size_t keep = n < dst->capacity ? n : dst->capacity;
+  memcpy(dst->heap, all + (n - keep), keep * sizeof(*all));
+  dst->size = keep;
+  memset(dst->index, 0xFF, (dst->index_mask + 1) * sizeof(uint32_t));
+  for (size_t i = 0; i < keep; i++) {
+    size_t slot = sketch_find_slot(dst, dst->heap[i].word, dst->heap[i].hash);
+    dst->heap[i].slot = (uint32_t)slot;
+    dst->index[slot] = (uint32_t)i;
+  }
+
+  free(all);
+  sketch_free(src);
+}
+
+static void *counter_thread_func(void *param);
+static void *private_counter_thread_func(void *param);
+static void *sketch_counter_thread_func(void *param);
 
-    // TODO: Prepare the arguments and launch the threads
+// Shared-table version, kept as a baseline for count_words_parallel
+static count_map_t count_words_striped(const char *text, size_t len,
+                                       size_t thread_count) {
+  // Threads share one striped_map_t, so they only contend when two of them
+  // insert a new word into the same lock stripe at the same time.
+  striped_map_t map;
+
+  pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+  count_thread_args_t **threads_args =
+      malloc(thread_count * sizeof(count_thread_args_t *));
+  size_t *bounds = malloc((thread_count + 1) * sizeof(size_t));
+  if (!threads || !threads_args || !bounds) {
+    perror("malloc");
+    exit(1);
+  }
+
+  split_text(text, len, thread_count, bounds);
+  // Assume roughly one distinct word per 64 bytes of text
+  striped_map_init(&map, len / 64);
+
+  // Launch threads
+  for (size_t i = 0; i < thread_count; i++) {
     threads_args[i] =
-        pack_args(&map, thread_arg_words, thread_arg_num_words, &count_mutex);
-    pthread_create(&threads[i], NULL, counter_thread_func, threads_args[i]);
+        pack_args(&map, text + bounds[i], bounds[i + 1] - bounds[i]);
+    int err =
+        pthread_create(&threads[i], NULL, counter_thread_func, threads_args[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(1);
+    }
   }
 
-  // TODO: Wait for threads to finish
-  for (size_t i = 0; i < THREAD_COUNT; i++) {
+  for (size_t i = 0; i < thread_count; i++) {
     pthread_join(threads[i], NULL);
     free(threads_args[i]);
   }
 
-  // TODO: Cleanup
-  pthread_mutex_destroy(&count_mutex);
+  free(bounds);
+  free(threads_args);
+  free(threads);
+  return striped_map_to_count_map(&map);
+}
+
+// Starts one thread_func per byte range of text and waits for all of them.
+// Exactly one of maps and sketches is used, depending on thread_func. Every
+// thread owns a range and a place in the merge, so if any of them cannot be
+// started this exits rather than leave the others waiting at the barrier.
+static void run_merging_threads(const char *text, size_t len,
+                                size_t thread_count,
+                                void *(*thread_func)(void *),
+                                count_map_t *maps, space_saving_t *sketches,
+                                size_t sketch_capacity) {
+  pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+  merge_thread_args_t *threads_args =
+      malloc(thread_count * sizeof(merge_thread_args_t));
+  size_t *bounds = malloc((thread_count + 1) * sizeof(size_t));
+  pthread_barrier_t barrier;
+  if (!threads || !threads_args || !bounds || (!maps && !sketches)) {
+    perror("malloc");
+    exit(1);
+  }
+
+  split_text(text, len, thread_count, bounds);
+  pthread_barrier_init(&barrier, NULL, (unsigned)thread_count);
+
+  for (size_t i = 0; i < thread_count; i++) {
+    threads_args[i].maps = maps;
+    threads_args[i].sketches = sketches;
+    threads_args[i].sketch_capacity = sketch_capacity;
+    threads_args[i].index = i;
+    threads_args[i].thread_count = thread_count;
+    threads_args[i].text = text + bounds[i];
+    threads_args[i].len = bounds[i + 1] - bounds[i];
+    threads_args[i].barrier = &barrier;
+    int err = pthread_create(&threads[i], NULL, thread_func, &threads_args[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(1);
+    }
+  }
+
+  for (size_t i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_barrier_destroy(&barrier);
+  free(bounds);
+  free(threads_args);
+  free(threads);
+}
 
+// Each thread counts its chunk into a private map with no synchronisation,
+// then the maps are folded together in log2(thread_count) parallel rounds.
+static count_map_t count_words_parallel(const char *text, size_t len,
+                                        size_t thread_count) {
+  count_map_t *maps = malloc(thread_count * sizeof(count_map_t));
+  run_merging_threads(text, len, thread_count, private_counter_thread_func,
+                      maps, NULL, 0);
+  count_map_t map = maps[0];
+  free(maps);
   return map;
 }
 
-// Takes in an array of words of size num_words and
+// Like count_words_parallel, but each thread keeps a Space-Saving sketch of
+// `capacity` counters instead of a full map, so rare words cost nothing.
+static space_saving_t count_top_k_approx(const char *text, size_t len,
+                                         size_t thread_count,
+                                         size_t capacity) {
+  space_saving_t *sketches = malloc(thread_count * sizeof(space_saving_t));
+  run_merging_threads(text, len, thread_count, sketch_counter_thread_func,
+                      NULL, sketches, capacity);
+  space_saving_t sketch = sketches[0];
+  free(sketches);
+  return sketch;
+}
+
+// Takes in a block of text of len bytes and
 // returns a hash table where the key is the word
 // and the value is the number of occurrences
-static word_count_entry_t *count_words_seq(word_t *words, size_t num_words) {
-  word_count_entry_t *map = NULL;
+static count_map_t count_words_seq(const char *text, size_t len) {
+  count_map_t map;
+  count_map_init(&map, 0);
 
-  // Pass all the words as a single chunk
-  add_word_counts_in_chunk(&map, words, num_words, NULL);
+  // Pass all the text as a single chunk
+  add_word_counts_in_chunk(&map, text, len, NULL);
 
   return map;
 }
 
-int sort_func(word_count_entry_t *a, word_count_entry_t *b);
+// Maps a whole file read-only. An empty file is left unmapped (*text is
+// NULL) but still counts as read. Returns -1 if the file cannot be read.
+static int map_file(const char *path, const char **text, size_t *len) {
+  *text = NULL;
+  *len = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return -1;
+  }
 
-void print_counts(count_map_t);
-void delete_table(count_map_t);
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
 
-int main(void) {
-  word_t words_in[13] = {"the",  "quick", "brown", "fox", "jumps",
-                         "over", "the",   "lazy",  "dog", "the",
-                         "the",  "fox",   "brown"};
-  const size_t words_in_len = 13;
-  count_map_t word_map = NULL;
+  void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+  madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+  *text = addr;
+  *len = (size_t)st.st_size;
+  return 0;
+}
 
-  // Task 2: Replace this function call with the parallelized version.
-  word_map = count_words_seq(words_in, words_in_len);
-  // word_map = count_words_parallel(words_in, words_in_len);
+int sort_func(const void *a, const void *b);
 
-  // Print table
-  if (word_map) {
-    // --------- Task 1 --------- \\
-    // Sort the table by the sort function in uthash using `sort_func`.
-    // TODO
-    HASH_SORT(word_map, sort_func);
+void sort_counts(count_map_t *);
+void print_counts(count_map_t *);
+int print_top_k(count_map_t *, size_t k);
+void print_top_k_approx(space_saving_t *, size_t k);
+void run_benchmark(size_t num_words, size_t max_threads);
 
-    print_counts(word_map);
+int main(int argc, char *argv[]) {
+  long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t bench_words = 0;
+  size_t top_k = 0;
+  size_t sketch_capacity = 0;
+  int approx = 0;
+  int status = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:b:k:am:")) != -1) {
+    switch (opt) {
+    case 't':
+      thread_count = atol(optarg);
+      break;
+    case 'b':
+      bench_words = strtoull(optarg, NULL, 10);
+      break;
+    case 'k':
+      top_k = strtoull(optarg, NULL, 10);
+      break;
+    case 'a':
+      approx = 1;
+      break;
+    case 'm':
+      sketch_capacity = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-t threads] [-b benchmark_words] "
+              "[-k top_k [-a [-m counters]]] [file...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (thread_count < 1) {
+    fprintf(stderr, "Thread count must be at least 1\n");
+    return 1;
   }
+  if (approx && top_k == 0) {
+    fprintf(stderr, "-a needs -k\n");
+    return 1;
+  }
+  if (approx && (top_k > SKETCH_MAX_CAPACITY ||
+                 sketch_capacity > SKETCH_MAX_CAPACITY)) {
+    fprintf(stderr, "-k and -m can be at most %zu with -a\n",
+            SKETCH_MAX_CAPACITY);
+    return 1;
+  }
+  if (sketch_capacity == 0) {
+    // top_k is at most SKETCH_MAX_CAPACITY here, so this cannot overflow
+    sketch_capacity = top_k < SKETCH_MAX_CAPACITY / SKETCH_COUNTERS_PER_K
+                          ? top_k * SKETCH_COUNTERS_PER_K
+                          : SKETCH_MAX_CAPACITY;
+  } else if (sketch_capacity < top_k) {
+    fprintf(stderr, "-m must be at least -k\n");
+    return 1;
+  }
+
+  init_word_chars();
 
-  // Cleanup
-  if (word_map) {
-    delete_table(word_map);
+  if (bench_words > 0) {
+    run_benchmark(bench_words, (size_t)thread_count);
+    return 0;
   }
 
-  return 0;
+  static const char sample[] =
+      "the quick brown fox jumps over the lazy dog the the fox brown";
+
+  // Counts hold pointers into the files, so they stay mapped until the
+  // results have been printed.
+  int num_files = argc - optind;
+  int num_inputs = num_files > 0 ? num_files : 1;
+  const char **texts = calloc(num_inputs, sizeof(char *));
+  size_t *lens = calloc(num_inputs, sizeof(size_t));
+  if (num_files == 0) {
+    texts[0] = sample;
+    lens[0] = sizeof(sample) - 1;
+  }
+  // A file that cannot be read is skipped, but the run still fails
+  for (int i = 0; i < num_files; i++) {
+    if (map_file(argv[optind + i], &texts[i], &lens[i]) != 0)
+      status = 1;
+  }
+
+  if (approx) {
+    space_saving_t sketch;
+    if (sketch_init(&sketch, sketch_capacity) != 0) {
+      perror("sketch_init");
+      status = 1;
+    } else {
+      for (int i = 0; i < num_inputs; i++) {
+        if (!texts[i])
+          continue;
+        space_saving_t file_sketch = count_top_k_approx(
+            texts[i], lens[i], (size_t)thread_count, sketch_capacity);
+        sketch_merge(&sketch, &file_sketch);
+      }
+      print_top_k_approx(&sketch, top_k);
+      sketch_free(&sketch);
+    }
+  } else {
+    count_map_t word_map;
+    count_map_init(&word_map, 0);
+    for (int i = 0; i < num_inputs; i++) {
+      if (!texts[i])
+        continue;
+      count_map_t file_map =
+          count_words_parallel(texts[i], lens[i], (size_t)thread_count);
+      merge_maps(&word_map, file_map);
+    }
+
+    // Print table
+    if (top_k > 0) {
+      if (print_top_k(&word_map, top_k) != 0)
+        status = 1;
+    } else {
+      sort_counts(&word_map);
+      print_counts(&word_map);
+    }
+
+    // Cleanup
+    delete_table(&word_map);
+  }
+
+  for (int i = 0; i < num_files; i++) {
+    if (texts[i])
+      munmap((void *)texts[i], lens[i]);
+  }
+  free(lens);
+  free(texts);
+
+  return status;
 }
 
-word_count_entry_t *create_entry(word_t word, size_t count) {
-  word_count_entry_t *ptr = malloc(sizeof(word_count_entry_t));
-  ptr->word = word;
-  ptr->count = count;
-  return ptr;
+int sort_func(const void *a, const void *b) {
+  const word_count_entry_t *x = a;
+  const word_count_entry_t *y = b;
+  size_t n = x->len < y->len ? x->len : y->len;
+  int cmp = memcmp(entry_key(x), entry_key(y), n);
+  if (cmp != 0)
+    return cmp;
+  return (x->len > y->len) - (x->len < y->len);
 }
 
-int sort_func(word_count_entry_t *a, word_count_entry_t *b) {
-  return strcmp(a->word, b->word);
+// Sorts the entry array by word and re-indexes it, so the map stays usable
+void sort_counts(count_map_t *word_map) {
+  qsort(word_map->entries, word_map->num_entries, sizeof(word_count_entry_t),
+        sort_func);
+  rebuild_slots(word_map, word_map->num_slots);
 }
 
-void print_counts(count_map_t word_map) {
+void print_counts(count_map_t *word_map) {
   printf("%-32s%-10s\n", "Word", "Count");
-  word_count_entry_t *current, *tmp;
-  HASH_ITER(hh, word_map, current, tmp) {
-    printf("%-32s%-10zu\n", current->word, current->count);
+  for (size_t i = 0; i < word_map->num_entries; i++) {
+    word_count_entry_t *current = &word_map->entries[i];
+    printf("%-32.*s%-10zu\n", (int)current->len, entry_key(current),
+           current->count);
   }
 }
 
-void delete_table(count_map_t word_map) {
-  word_count_entry_t *current, *tmp;
-  HASH_ITER(hh, word_map, current, tmp) {
-    HASH_DEL(word_map, current);
-    free(current);
+// Orders by count, highest first, then by word
+static int rank_cmp(const word_count_entry_t *a, const word_count_entry_t *b) {
+  if (a->count != b->count)
+    return a->count > b->count ? -1 : 1;
+  return sort_func(a, b);
+}
+
+static int rank_ptr_cmp(const void *a, const void *b) {
+  return rank_cmp(*(word_count_entry_t *const *)a,
+                  *(word_count_entry_t *const *)b);
+}
+
+// Selects the k best-ranked entries with a size-k heap whose root is the
+// worst of them, so only those k get sorted. Returns -1 if the heap cannot
+// be allocated.
+int print_top_k(count_map_t *word_map, size_t k) {
+  if (k > word_map->num_entries)
+    k = word_map->num_entries;
+  word_count_entry_t **heap = malloc(k * sizeof(word_count_entry_t *));
+  if (!heap && k > 0) {
+    perror("print_top_k");
+    return -1;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < word_map->num_entries; i++) {
+    word_count_entry_t *e = &word_map->entries[i];
+    size_t pos;
+    if (n < k) {
+      pos = n++;
+      while (pos > 0 && rank_cmp(heap[(pos - 1) / 2], e) < 0) {
+        heap[pos] = heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+      }
+      heap[pos] = e;
+    } else if (rank_cmp(e, heap[0]) < 0) {
+      pos = 0;
+      for (;;) {
+        size_t worst = 2 * pos + 1;
+        if (worst >= n)
+          break;
+        if (worst + 1 < n && rank_cmp(heap[worst + 1], heap[worst]) > 0)
+          worst++;
+        if (rank_cmp(heap[worst], e) <= 0)
+          break;
+        heap[pos] = heap[worst];
+        pos = worst;
+      }
+      heap[pos] = e;
+    }
+  }
+
+  qsort(heap, n, sizeof(word_count_entry_t *), rank_ptr_cmp);
+  printf("%-32s%-10s\n", "Word", "Count");
+  for (size_t i = 0; i < n; i++) {
+    printf("%-32.*s%-10zu\n", (int)heap[i]->len, entry_key(heap[i]),
+           heap[i]->count);
+  }
+  free(heap);
+  return 0;
+}
+
+static int counter_rank_cmp(const void *a, const void *b) {
+  return -counter_count_cmp(a, b);
+}
+
+void print_top_k_approx(space_saving_t *sketch, size_t k) {
+  qsort(sketch->heap, sketch->size, sizeof(sketch_counter_t),
+        counter_rank_cmp);
+  // Sorting breaks the heap order; the sketch is only freed after this
+  printf("%-32s%-10s%-10s\n", "Word", "Count", "Overcount");
+  for (size_t i = 0; i < k && i < sketch->size; i++) {
+    sketch_counter_t *c = &sketch->heap[i];
+    printf("%-32.*s%-10zu%-10zu\n", (int)c->word.len, c->word.ptr, c->count,
+           c->error);
   }
 }
 
-count_thread_args_t *pack_args(count_map_t *map, word_t *words,
-                               size_t num_words, pthread_mutex_t *lock) {
+void delete_table(count_map_t *word_map) {
+  free(word_map->ctrl);
+  free(word_map->slots);
+  free(word_map->entries);
+}
+
+count_thread_args_t *pack_args(striped_map_t *map, const char *text,
+                               size_t len) {
   count_thread_args_t *args = malloc(sizeof(count_thread_args_t));
   args->map = map;
-  args->words = words;
-  args->num_words = num_words;
-  args->lock = lock;
+  args->text = text;
+  args->len = len;
   return args;
 }
 
 static void *counter_thread_func(void *param) {
-  // Call count_words_in_chunk with the appropriate arguments
   count_thread_args_t *args = (count_thread_args_t *)param;
-  add_word_counts_in_chunk(args->map, args->words, args->num_words, args->lock);
+  const char *pos = args->text;
+  const char *end = args->text + args->len;
+  word_t word;
+  while (next_word(&pos, end, &word))
+    striped_map_add(args->map, word);
+
+  return NULL;
+}
+
+static void *private_counter_thread_func(void *param) {
+  merge_thread_args_t *args = (merge_thread_args_t *)param;
+  count_map_t *maps = args->maps;
+  size_t i = args->index;
+
+  count_map_init(&maps[i], 0);
+  add_word_counts_in_chunk(&maps[i], args->text, args->len, NULL);
+
+  // Round with stride `step`: thread i absorbs thread i + step's map when i is
+  // a multiple of 2 * step. The barrier makes sure both maps are finished.
+  for (size_t step = 1; step < args->thread_count; step *= 2) {
+    pthread_barrier_wait(args->barrier);
+    if (i % (2 * step) == 0 && i + step < args->thread_count)
+      merge_maps(&maps[i], maps[i + step]);
+  }
 
   return NULL;
 }
+
+static void *sketch_counter_thread_func(void *param) {
+  merge_thread_args_t *args = (merge_thread_args_t *)param;
+  space_saving_t *sketches = args->sketches;
+  size_t i = args->index;
+
+  if (sketch_init(&sketches[i], args->sketch_capacity) != 0) {
+    perror("sketch_init");
+    exit(1);
+  }
+  const char *pos = args->text;
+  const char *end = args->text + args->len;
+  word_t word;
+  while (next_word(&pos, end, &word))
+    sketch_add(&sketches[i], word, hash_word(word));
+
+  for (size_t step = 1; step < args->thread_count; step *= 2) {
+    pthread_barrier_wait(args->barrier);
+    if (i % (2 * step) == 0 && i + step < args->thread_count)
+      sketch_merge(&sketches[i], &sketches[i + step]);
+  }
+
+  return NULL;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Builds a skewed synthetic text of num_words words drawn from BENCH_VOCAB
+// distinct words, separated by spaces and newlines. The caller frees it.
+static char *make_corpus(size_t num_words, size_t *len) {
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  char(*vocab)[16] = malloc(BENCH_VOCAB * sizeof(*vocab));
+  for (size_t v = 0; v < BENCH_VOCAB; v++) {
+    size_t n = 2 + next_random(&rng) % 13;
+    for (size_t c = 0; c < n; c++)
+      vocab[v][c] = (char)('a' + next_random(&rng) % 26);
+    snprintf(vocab[v] + n, 16 - n, "%zu", v % 10);
+  }
+
+  char *text = malloc(num_words * 16 + 1);
+  char *out = text;
+  for (size_t i = 0; i < num_words; i++) {
+    // Picking below a random bound favours low indices, like real text
+    size_t bound = next_random(&rng) % BENCH_VOCAB + 1;
+    const char *w = vocab[next_random(&rng) % bound];
+    size_t n = strlen(w);
+    memcpy(out, w, n);
+    out += n;
+    *out++ = i % 12 == 11 ? '\n' : ' ';
+  }
+  *len = (size_t)(out - text);
+  free(vocab);
+  return text;
+}
+
+static void report(const char *name, size_t threads, double secs,
+                   size_t num_words, count_map_t map) {
+  size_t total = 0;
+  for (size_t i = 0; i < map.num_entries; i++)
+    total += map.entries[i].count;
+  printf("%-10s%-9zu%-12.4f%-14.1f%-10zu%s\n", name, threads, secs,
+         num_words / secs / 1e6, map.num_entries,
+         total == num_words ? "" : "  (count mismatch!)");
+}
+
+void run_benchmark(size_t num_words, size_t max_threads) {
+  size_t len;
+  char *text = make_corpus(num_words, &len);
+
+  printf("%zu words (%zu bytes), up to %zu threads\n", num_words, len,
+         max_threads);
+  printf("%-10s%-9s%-12s%-14s%-10s\n", "Mode", "Threads", "Seconds",
+         "Mwords/s", "Distinct");
+
+  double t0 = now_seconds();
+  count_map_t map = count_words_seq(text, len);
+  report("seq", 1, now_seconds() - t0, num_words, map);
+  delete_table(&map);
+
+  // Thread counts 1, 2, 4, ... and finally max_threads itself
+  for (size_t t = 1;; t = t * 2 > max_threads ? max_threads : t * 2) {
+    t0 = now_seconds();
+    map = count_words_striped(text, len, t);
+    report("striped", t, now_seconds() - t0, num_words, map);
+    delete_table(&map);
+
+    t0 = now_seconds();
+    map = count_words_parallel(text, len, t);
+    report("private", t, now_seconds() - t0, num_words, map);
+    delete_table(&map);
+
+    if (t == max_threads)
+      break;
+  }
+
+  free(text);
+}
@@ -70,6 +70,7 @@ int main() {
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -80,6 +81,12 @@ int main() {
 #define BUF_SIZE 64
 #define PORT 8000
 #define LISTEN_BACKLOG 32
+#define DEFAULT_WORKERS 8
+#define DEFAULT_STACK_KB 64
+// Accepted-but-unserved connections we are willing to hold. Once this fills
+// up the acceptor stops calling accept(), so further connections wait in the
+// kernel's listen backlog instead of costing us memory.
+#define QUEUE_CAPACITY LISTEN_BACKLOG
 
 #define handle_error(msg)                                                      \
   do {                                                                         \
@@ -98,20 +105,63 @@ struct client_info {
   int client_id;
 };
 
-void *handle_client(void *arg) {
-  struct client_info *client = (struct client_info *)arg;
+// Fixed-size ring of accepted connections shared by the acceptor and workers
+struct conn_queue {
+  struct client_info items[QUEUE_CAPACITY];
+  size_t head;
+  size_t count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+struct conn_queue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
 
-  int cfd = client->cfd;
-  int id = client->client_id;
+void queue_wait_for_space(struct conn_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == QUEUE_CAPACITY) {
+    pthread_cond_wait(&q->not_full, &q->lock);
+  }
+  pthread_mutex_unlock(&q->lock);
+}
 
-  free(client);
+// Only the acceptor pushes, so space reserved by queue_wait_for_space is
+// still there when we get here.
+void queue_push(struct conn_queue *q, struct client_info ci) {
+  pthread_mutex_lock(&q->lock);
+  q->items[(q->head + q->count) % QUEUE_CAPACITY] = ci;
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+struct client_info queue_pop(struct conn_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0) {
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  }
+  struct client_info ci = q->items[q->head];
+  q->head = (q->head + 1) % QUEUE_CAPACITY;
+  q->count--;
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return ci;
+}
+
+void handle_client(struct client_info client) {
+  int cfd = client.cfd;
+  int id = client.client_id;
 
   char buf[BUF_SIZE];
   ssize_t num_read;
 
   printf("New client created! ID %d on socket FD %d\n", id, cfd);
 
-  while ((num_read = read(cfd, buf, BUF_SIZE)) > 0) {
+  while ((num_read = read(cfd, buf, BUF_SIZE - 1)) > 0) {
     buf[num_read] = '\0';
 
     pthread_mutex_lock(&count_mutex);
@@ -123,15 +173,64 @@ void *handle_client(void *arg) {
   }
 
   close(cfd);
-  printf("Ending thread for client %d\n", id);
+  printf("Ending session for client %d\n", id);
+}
 
+void *worker_main(void *arg) {
+  struct conn_queue *q = (struct conn_queue *)arg;
+  for (;;) {
+    handle_client(queue_pop(q));
+  }
   return NULL;
 }
 
-int main() {
+// Start up to `count` detached workers, returning how many actually started.
+// Running with fewer workers than asked for beats not running at all.
+int start_workers(int count, size_t stack_size) {
+  pthread_attr_t attr;
+  if (pthread_attr_init(&attr) != 0) {
+    handle_error("pthread_attr_init");
+  }
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (stack_size < PTHREAD_STACK_MIN) {
+    stack_size = PTHREAD_STACK_MIN;
+  }
+  int err = pthread_attr_setstacksize(&attr, stack_size);
+  if (err != 0) {
+    fprintf(stderr, "pthread_attr_setstacksize: %s\n", strerror(err));
+  }
+
+  int started = 0;
+  for (int i = 0; i < count; i++) {
+    pthread_t tid;
+    err = pthread_create(&tid, &attr, worker_main, &queue);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s (running with %d workers)\n",
+              strerror(err), started);
+      break;
+    }
+    started++;
+  }
+
+  pthread_attr_destroy(&attr);
+  return started;
+}
+
+int main(int argc, char *argv[]) {
   struct sockaddr_in addr;
   int sfd;
 
+  if (argc > 3) {
+    fprintf(stderr, "Usage: %s [workers] [stack KiB]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  int workers = argc > 1 ? atoi(argv[1]) : DEFAULT_WORKERS;
+  long stack_kb = argc > 2 ? atol(argv[2]) : DEFAULT_STACK_KB;
+  if (workers < 1 || stack_kb < 1) {
+    fprintf(stderr, "workers and stack size must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+
   sfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sfd == -1) {
     handle_error("socket");
@@ -150,9 +249,28 @@ int main() {
     handle_error("listen");
   }
 
+  if (start_workers(workers, (size_t)stack_kb * 1024) == 0) {
+    fprintf(stderr, "Could not start any worker threads\n");
+    exit(EXIT_FAILURE);
+  }
+
   for (;;) {
+    // Don't take a connection off the backlog until a queue slot is free
+    queue_wait_for_space(&queue);
+
     int cfd = accept(sfd, NULL, NULL);
     if (cfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        // Out of resources: leave pending connections in the backlog and
+        // retry shortly rather than taking the whole server down.
+        perror("accept");
+        usleep(10000);
+        continue;
+      }
       handle_error("accept");
     }
 
@@ -160,16 +278,8 @@ int main() {
     int assigned_id = client_id_counter++;
     pthread_mutex_unlock(&client_id_mutex);
 
-    struct client_info *ci = malloc(sizeof(struct client_info));
-    ci->cfd = cfd;
-    ci->client_id = assigned_id;
-
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, handle_client, ci) != 0) {
-      handle_error("pthread_create");
-    }
-
-    pthread_detach(tid);
+    struct client_info ci = {.cfd = cfd, .client_id = assigned_id};
+    queue_push(&queue, ci);
   }
 
   close(sfd);